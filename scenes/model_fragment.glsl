@@ -24,8 +24,19 @@ uniform sampler2D material_ks_txt;  // material ks texture
 uniform bool material_norm_txt_on;    // material norm texture enabled
 uniform sampler2D material_norm_txt;  // material norm texture
 
+uniform bool lod_fading;            // whether the mesh is cross-fading between levels of detail
+uniform float lod_fade;             // cross-fade progress, the fraction of pixels drawn by the incoming level
+uniform bool lod_fade_out;          // whether the mesh is the outgoing level
+
 // main
 void main() {
+    // screen-door cross-fade: incoming and outgoing levels draw complementary dither patterns
+    if(lod_fading) {
+        float bayer[16] = float[16](0.0,8.0,2.0,10.0, 12.0,4.0,14.0,6.0, 3.0,11.0,1.0,9.0, 15.0,7.0,13.0,5.0);
+        int i = int(mod(gl_FragCoord.y,4.0))*4 + int(mod(gl_FragCoord.x,4.0));
+        float t = (bayer[i] + 0.5) / 16.0;
+        if((t < lod_fade) == lod_fade_out) discard;
+    }
     // re-normalize normals
     vec3 n = normalize(norm);
     // lookup normal map if needed
@@ -0,0 +1,61 @@
+#version 400
+
+layout(vertices = 4) out;
+
+in vec3 control_pos[];              // [from vertex shader] control point position (in mesh coordinate frame)
+
+out vec3 patch_pos[];               // [to evaluation shader] control point position (in mesh coordinate frame)
+
+uniform mat4 mesh_frame;            // mesh frame (as a matrix)
+uniform mat4 camera_frame_inverse;  // inverse of the camera frame (as a matrix)
+uniform mat4 camera_projection;     // camera projection
+
+uniform bool tess_surface;          // whether the patch is a surface (quad or sphere) or a bezier segment
+uniform bool tess_sphere;           // whether the surface is a sphere
+uniform float tess_radius;          // sphere radius
+uniform float tess_pixels;          // target length in pixels of tessellated edges
+uniform vec2 viewport_size;         // viewport size in pixels
+
+// project a point in mesh coordinates to pixels
+vec2 screen(vec3 p) {
+    vec4 c = camera_projection * camera_frame_inverse * mesh_frame * vec4(p,1);
+    return c.xy / max(c.w,1e-4) * viewport_size * 0.5;
+}
+
+// number of segments needed to tessellate a length in pixels
+float segments(float len, float minlevel) {
+    return clamp(len / tess_pixels, minlevel, float(gl_MaxTessGenLevel));
+}
+
+// main function
+void main() {
+    patch_pos[gl_InvocationID] = control_pos[gl_InvocationID];
+    if(gl_InvocationID != 0) return;
+    
+    vec2 s0 = screen(control_pos[0]), s1 = screen(control_pos[1]);
+    vec2 s2 = screen(control_pos[2]), s3 = screen(control_pos[3]);
+    if(!tess_surface) {
+        // bezier segment: one isoline, split by the length of the control polygon on screen
+        gl_TessLevelOuter[0] = 1;
+        gl_TessLevelOuter[1] = segments(distance(s0,s1) + distance(s1,s2) + distance(s2,s3), 1);
+    } else {
+        float level_u, level_v;
+        if(tess_sphere) {
+            // sphere: split meridians and parallels by the projected circumference
+            float depth = max(-(camera_frame_inverse * mesh_frame * vec4(0,0,0,1)).z, 1e-4);
+            float radius_pixels = tess_radius * camera_projection[1][1] * viewport_size.y * 0.5 / depth;
+            level_u = segments(2 * 3.14159265 * radius_pixels, 4);
+            level_v = segments(3.14159265 * radius_pixels, 2);
+        } else {
+            // quad: split by the longest projected side in each direction
+            level_u = segments(max(distance(s0,s1), distance(s3,s2)), 1);
+            level_v = segments(max(distance(s0,s3), distance(s1,s2)), 1);
+        }
+        gl_TessLevelOuter[0] = level_v;
+        gl_TessLevelOuter[1] = level_u;
+        gl_TessLevelOuter[2] = level_v;
+        gl_TessLevelOuter[3] = level_u;
+        gl_TessLevelInner[0] = level_u;
+        gl_TessLevelInner[1] = level_v;
+    }
+}
@@ -0,0 +1,26 @@
+#version 400
+
+layout(isolines, equal_spacing) in;
+
+in vec3 patch_pos[];                // [from control shader] bezier control points (in mesh coordinate frame)
+
+out vec3 pos;                       // [to fragment shader] vertex position (in world coordinate)
+out vec3 norm;                      // [to fragment shader] curve tangent (in world coordinate)
+out vec2 texcoord;                  // [to fragment shader] vertex texture coordinate
+
+uniform mat4 mesh_frame;            // mesh frame (as a matrix)
+uniform mat4 camera_frame_inverse;  // inverse of the camera frame (as a matrix)
+uniform mat4 camera_projection;     // camera projection
+
+// main function
+void main() {
+    // evaluate the cubic bezier segment and its tangent with the bernstein polynomials
+    float t = gl_TessCoord.x, s = 1 - t;
+    vec3 p = s*s*s * patch_pos[0] + 3*s*s*t * patch_pos[1] + 3*s*t*t * patch_pos[2] + t*t*t * patch_pos[3];
+    vec3 d = s*s * (patch_pos[1]-patch_pos[0]) + 2*s*t * (patch_pos[2]-patch_pos[1]) + t*t * (patch_pos[3]-patch_pos[2]);
+    // transform to world space, the tangent is used as normal like for cpu subdivided lines
+    pos = (mesh_frame * vec4(p,1)).xyz;
+    norm = (mesh_frame * vec4(d,0)).xyz;
+    texcoord = vec2(t,0);
+    gl_Position = camera_projection * camera_frame_inverse * vec4(pos,1);
+}
@@ -0,0 +1,37 @@
+#version 400
+
+layout(quads, equal_spacing, ccw) in;
+
+in vec3 patch_pos[];                // [from control shader] quad corners (in mesh coordinate frame)
+
+out vec3 pos;                       // [to fragment shader] vertex position (in world coordinate)
+out vec3 norm;                      // [to fragment shader] vertex normal (in world coordinate)
+out vec2 texcoord;                  // [to fragment shader] vertex texture coordinate
+
+uniform mat4 mesh_frame;            // mesh frame (as a matrix)
+uniform mat4 camera_frame_inverse;  // inverse of the camera frame (as a matrix)
+uniform mat4 camera_projection;     // camera projection
+
+uniform bool tess_sphere;           // whether the surface is a sphere
+uniform float tess_radius;          // sphere radius
+
+// main function
+void main() {
+    float u = gl_TessCoord.x, v = gl_TessCoord.y;
+    vec3 p, n;
+    if(tess_sphere) {
+        // sphere parametrized by phi (u) and theta (v), like the cpu tessellation
+        float phi = u * 2 * 3.14159265, theta = v * 3.14159265;
+        n = vec3(cos(phi)*sin(theta), sin(phi)*sin(theta), cos(theta));
+        p = tess_radius * n;
+    } else {
+        // bilinear interpolation of the quad corners
+        p = mix(mix(patch_pos[0],patch_pos[1],u), mix(patch_pos[3],patch_pos[2],u), v);
+        n = vec3(0,0,1);
+    }
+    // transform to world space
+    pos = (mesh_frame * vec4(p,1)).xyz;
+    norm = (mesh_frame * vec4(n,0)).xyz;
+    texcoord = vec2(u,v);
+    gl_Position = camera_projection * camera_frame_inverse * vec4(pos,1);
+}
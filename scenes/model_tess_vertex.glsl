@@ -0,0 +1,11 @@
+#version 400
+
+in vec3 vertex_pos;                 // control point position (in mesh coordinate frame)
+
+out vec3 control_pos;               // [to control shader] control point position (in mesh coordinate frame)
+
+// main function
+void main() {
+    // pass control points through, they are transformed after evaluation
+    control_pos = vertex_pos;
+}
@@ -1,13 +1,37 @@
 #include "common.h"
 #include "scene.h"
 #include "image.h"
+#include "raster.h"
 #include "gls.h"
 
 string scene_filename;  // scene filename
 string image_filename;  // image filename
 Scene* scene;           // scene arrays
 
+// camera keyframe of a turntable sequence, relative to the scene camera
+struct TurntableKey {
+    int     frame = 0;      // frame of the key
+    float   dolly = 0;      // dolly towards the focus point
+    vec2f   pan = zero2f;   // pan along the camera x and y axes
+};
+
+int turntable_frames = 0;               // frames of the turntable sequence (0 to render single images)
+vector<TurntableKey> turntable_keys;    // dolly and pan keyframes, sorted by frame
+
+// scene value set from the command line
+struct SceneValue {
+    string      path;           // member path (see set_scene_value)
+    string      text;           // value as given
+    jsonvalue   value;          // parsed value
+};
+
+vector<SceneValue> scene_values;        // values set on every scene once loaded
+vector<vector<SceneValue>> sweep_jobs;  // values of each image of the sweep of the scene (empty if not sweeping)
+Scene* sweep_base = nullptr;            // scene the sweep images are copied from, loaded once
+
 void uiloop();          // UI loop
+void headless(const vector<pair<string,string>>& jobs, const jsonvalue& args);  // ...
+                        // offscreen rendering of (scene, image) filename pairs
 
 
 // map used to uniquify edges
@@ -331,17 +355,33 @@ void subdivide_bezier(Mesh* bezier) {
 
 
 
+// copy of a mesh at an intermediate subdivision level, with normals, used as a coarser level of detail
+// (allocated in the arena of the mesh scene)
+Mesh* _make_lod(Mesh* mesh, Arena& arena, bool smooth) {
+    auto lod = arena.make<Mesh>(*mesh);
+    lod->subdivision_catmullclark_level = 0;
+    lod->_lods.clear();
+    if(smooth) smooth_normals(lod);
+    else facet_normals(lod);
+    return lod;
+}
+
 // apply Catmull-Clark mesh subdivision
 // does not subdivide texcoord
-void subdivide_catmullclark(Mesh* subdiv) {
+// if lods is set, keeps the intermediate levels in _lods, allocated in arena
+void subdivide_catmullclark(Mesh* subdiv, Arena& arena, bool lods = false) {
     // skip is needed
     if(not subdiv->subdivision_catmullclark_level) return;
     
     // allocate a working Mesh copied from the subdiv
     auto mesh = new Mesh(*subdiv);
+    auto lod_meshes = vector<Mesh*>();
     
     // foreach level
     for(auto l : range(subdiv->subdivision_catmullclark_level)) {
+        // keep the current level as a level of detail
+        if(lods) lod_meshes.push_back(_make_lod(mesh, arena, subdiv->subdivision_catmullclark_smooth));
+        
         // make empty pos and quad arrays
         auto pos = vector<vec3f>();
         auto quad = vector<vec4i>();
@@ -490,16 +530,24 @@ void subdivide_catmullclark(Mesh* subdiv) {
     if(subdiv->subdivision_catmullclark_smooth) smooth_normals(mesh);
     else facet_normals(mesh);
     
-    // copy back
-    *subdiv = *mesh;
+    // move back the geometry only, leaving frame and material to concurrent writers
+    subdiv->pos = std::move(mesh->pos);
+    subdiv->norm = std::move(mesh->norm);
+    subdiv->triangle = std::move(mesh->triangle);
+    subdiv->quad = std::move(mesh->quad);
+    subdiv->subdivision_catmullclark_level = 0;
+    subdiv->_lods = lod_meshes;
+    invalidate_bounds(subdiv);
     
     // clear
     delete mesh;
 }
 
-void subdivide_surface(Surface* surface) {
+// tessellate a surface into its display mesh, allocated in arena
+// if lods is set, also tessellates the lower subdivision levels into the display mesh _lods
+void subdivide_surface(Surface* surface, Arena& arena, bool lods = false) {
     // create mesh struct
-    auto mesh    = new Mesh{};
+    auto mesh    = arena.make<Mesh>();
     // copy frame
     mesh->frame  = surface->frame;
     // copy material
@@ -522,13 +570,10 @@ void subdivide_surface(Surface* surface) {
         auto p10 = vec3f( 1,-1,0) * radius;
         auto p11 = vec3f( 1, 1,0) * radius;
         
-        image3f image;
-        
-        if (surface->displacement_depth !=0){
-            
-            image = read_png("/Users/kikolam/Documents/Dartmouth/15S/CS77/assignment02/scenes/displacement_map.png", false);
-
-        }
+        // displacement is looked up at the mip level whose texels match the grid spacing,
+        // with the map rows flipped back to top to bottom order
+        auto displacement = (surface->displacement_depth != 0) ? surface->displacement_txt : nullptr;
+        auto displacement_lod = (displacement) ? log2(max(displacement->width()/(float)ci, displacement->height()/(float)cj)) : 0.0f;
         
         // foreach column
         for(auto i : range(ci+1)) {
@@ -541,15 +586,8 @@ void subdivide_surface(Surface* surface) {
                 // compute new point location
                 auto p = p00*u*v + p01*u*(1-v) + p10*(1-u)*v + p11*(1-u)*(1-v);
                 
-                if (surface->displacement_depth !=0){
-                
-                    //image3f image = read_png("/Users/kikolam/Documents/Dartmouth/15S/CS77/assignment02/scenes/displacement_map.png", false);
-                    
-                    vec3f new_color = image.at(i*image.width()/ci -1, j*image.height()/cj -1);
-                    //printf("%f", new_color.x);
-                    p += vec3f(0.0, 0.0, new_color.x);
-                }
-
+                // displace point along z
+                if(displacement) p.z += lookup_texture(displacement, vec2f(u,1-v), displacement_lod, false).x;
                 
                 // insert point into pos vector, remembering its index
                 vertexidx[make_pair(i,j)] = mesh->pos.size();
@@ -658,51 +696,354 @@ void subdivide_surface(Surface* surface) {
     
     // update _display_mesh of surface
     surface->_display_mesh = mesh;
+    
+    // tessellate lower levels as levels of detail
+    if(lods) {
+        for(auto l : range(surface->subdivision_level)) {
+            auto lod = Surface(*surface);
+            lod.subdivision_level = l;
+            subdivide_surface(&lod, arena);
+            mesh->_lods.push_back(lod._display_mesh);
+        }
+    }
+}
+
+// whether a surface can be tessellated on the gpu (displaced surfaces and faceted spheres are not)
+bool surface_gpu_tessellation(Surface* surface) {
+    return surface->displacement_depth == 0 and (surface->isquad or surface->subdivision_smooth);
 }
 
-void subdivide(Scene* scene) {
-    for(auto mesh : scene->meshes) {
-        if(mesh->subdivision_catmullclark_level) subdivide_catmullclark(mesh);
-        if(mesh->subdivision_bezier_level) subdivide_bezier(mesh);
+// make the display mesh of a surface tessellated on the gpu: its control cage, the quad corners
+// (spheres only use the frame and radius but keep the same four vertex patch)
+void subdivide_surface_cage(Surface* surface, Arena& arena) {
+    auto mesh    = arena.make<Mesh>();
+    mesh->frame  = surface->frame;
+    mesh->mat    = surface->mat;
+    mesh->pos    = { vec3f(-1,-1,0) * surface->radius, vec3f( 1,-1,0) * surface->radius,
+                     vec3f( 1, 1,0) * surface->radius, vec3f(-1, 1,0) * surface->radius };
+    mesh->norm   = vector<vec3f>(4, z3f);
+    surface->_display_mesh = mesh;
+}
+
+// subdivide scene meshes, shapes and surfaces, leaving splines and surfaces to the gpu if tessellated there
+// (instances draw their shape as subdivided; surfaces in instanced are drawn from a shared prototype instead)
+void subdivide(Scene* scene, const set<Surface*>& instanced = set<Surface*>()) {
+    auto meshes = scene->meshes;
+    for(auto& shape : scene->shapes) meshes.push_back(shape.second);
+    for(auto mesh : meshes) {
+        if(mesh->subdivision_catmullclark_level) subdivide_catmullclark(mesh, scene->arena, scene->draw_lod);
+        if(mesh->subdivision_bezier_level and not scene->draw_gpu_tessellation) subdivide_bezier(mesh);
+        invalidate_bounds(mesh);
     }
     for(auto surface : scene->surfaces) {
-        subdivide_surface(surface);
+        if(instanced.count(surface)) continue;
+        if(scene->draw_gpu_tessellation and surface_gpu_tessellation(surface)) subdivide_surface_cage(surface, scene->arena);
+        else subdivide_surface(surface, scene->arena, scene->draw_lod);
     }
 }
 
 
-// main function
-int main(int argc, char** argv) {
-    auto args = parse_cmdline(argc, argv,
-        { "02_model", "view scene",
-            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue() }  },
-            {  {"scene_filename", "",  "scene filename",   typeid(string), false, jsonvalue("scene.json")},
-               {"image_filename", "",  "image filename",   typeid(string), true,  jsonvalue("")}  }
-        });
-    
-    // generate/load scene either by creating a test scene or loading from json file
-    scene_filename = args.object_element("scene_filename").as_string();
+// set scene values from the command line, checking that they name scene members
+void set_scene_values(Scene* scene, const vector<SceneValue>& values) {
+    for(auto& value : values) {
+        error_if_not(set_scene_value(scene, value.path, value.value), "unknown scene value %s\n", value.path.c_str());
+    }
+}
+
+// parse a scene value given as "path=value", with a json value
+SceneValue parse_scene_value(const string& assignment) {
+    auto pos = assignment.find('=');
+    error_if_not(pos != string::npos, "scene values are set as path=value: %s\n", assignment.c_str());
+    auto text = assignment.substr(pos+1);
+    return { assignment.substr(0,pos), text, parse_json(text) };
+}
+
+// parse the values of a sweep given as "path=value,value,..." with json values,
+// or as "path=first:last[:step]" for the numbers from first to last included
+vector<SceneValue> parse_sweep(const string& sweep) {
+    auto pos = sweep.find('=');
+    error_if_not(pos != string::npos, "sweeps are given as path=values: %s\n", sweep.c_str());
+    auto path = sweep.substr(0,pos), text = sweep.substr(pos+1);
+    auto values = vector<SceneValue>();
+    if(text.find(':') != string::npos and text.find_first_of("[{\"") == string::npos) {
+        auto bounds = vector<double>();
+        auto bound = string();
+        std::istringstream stream(text);
+        while(std::getline(stream, bound, ':')) bounds.push_back(atof(bound.c_str()));
+        error_if_not(bounds.size() == 2 or bounds.size() == 3, "sweep ranges are given as first:last[:step]: %s\n", sweep.c_str());
+        auto step = (bounds.size() == 3) ? bounds[2] : 1.0;
+        error_if_not(step > 0, "sweep step is not positive: %s\n", sweep.c_str());
+        for(auto i = 0; bounds[0] + i*step <= bounds[1] + step*1e-6; i++) {
+            auto value = bounds[0] + i*step;
+            values.push_back({ path, tostring("%g", value), jsonvalue(value) });
+        }
+    } else {
+        // values are split at the commas outside of json arrays, objects and strings
+        auto depth = 0, start = 0;
+        auto quoted = false;
+        for(auto i : range(text.size()+1)) {
+            auto c = (i < (int)text.size()) ? text[i] : ',';
+            if(c == '"' and (i == 0 or text[i-1] != '\\')) quoted = not quoted;
+            if(quoted) continue;
+            if(c == '[' or c == '{') depth++;
+            if(c == ']' or c == '}') depth--;
+            if(c != ',' or depth > 0) continue;
+            auto value = text.substr(start, i-start);
+            values.push_back({ path, value, parse_json(value) });
+            start = i+1;
+        }
+    }
+    error_if_not(not values.empty(), "sweep without values: %s\n", sweep.c_str());
+    return values;
+}
+
+// expand sweeps into the values of every combination of their values, the last sweep varying fastest
+vector<vector<SceneValue>> expand_sweeps(const vector<vector<SceneValue>>& sweeps) {
+    auto jobs = vector<vector<SceneValue>>(1);
+    for(auto& sweep : sweeps) {
+        auto expanded = vector<vector<SceneValue>>();
+        for(auto& job : jobs) {
+            for(auto& value : sweep) {
+                expanded.push_back(job);
+                expanded.back().push_back(value);
+            }
+        }
+        jobs = std::move(expanded);
+    }
+    return jobs;
+}
+
+// describe the values of a sweep image
+string sweep_description(const vector<SceneValue>& values) {
+    auto description = string();
+    for(auto& value : values) description += ((description.empty()) ? "" : " ") + value.path + "=" + value.text;
+    return description;
+}
+
+// load a scene either by creating a test scene or loading from json file, setting scene,
+// scene_filename and image_filename (derived from the scene if empty), and apply the command line options
+void load_scene(const string& filename, const string& imagename, const jsonvalue& args) {
+    scene_filename = filename;
+    // the previous scene is freed at once, and its cached textures and meshes may then be evicted
+    delete scene;
     scene = nullptr;
     if(scene_filename.length() > 9 and scene_filename.substr(0,9) == "testscene") {
         int scene_type = atoi(scene_filename.substr(9).c_str());
         scene = create_test_scene(scene_type);
         scene_filename = scene_filename + ".json";
     } else {
-        scene = load_json_scene(scene_filename);
+        // meshes are subdivided on a worker thread as soon as they are read, overlapping subdivision
+        // with reading the rest of the file (subdivide leaves them as they are afterwards), unless
+        // scene values may change their subdivision first
+        auto lods = args.object_element("lod").as_bool();
+        auto subdivide_loaded = scene_values.empty() and sweep_jobs.empty();
+        auto loaded = std::deque<pair<Scene*,Mesh*>>();
+        auto loading = true;
+        std::mutex mutex;
+        std::condition_variable cond;
+        auto worker = std::thread([&]() {
+            while(true) {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&]() { return not loaded.empty() or not loading; });
+                if(loaded.empty()) return;
+                auto mesh = loaded.front();
+                loaded.pop_front();
+                lock.unlock();
+                subdivide_catmullclark(mesh.second, mesh.first->arena, lods);
+            }
+        });
+        // textures stay cached between scenes, so that a queue of scenes reads and uploads them once
+        scene = load_json_scene(scene_filename, [&](Scene* scene, Mesh* mesh) {
+            if(not subdivide_loaded) return;
+            { std::lock_guard<std::mutex> lock(mutex); loaded.push_back({scene, mesh}); }
+            cond.notify_one();
+        });
+        { std::lock_guard<std::mutex> lock(mutex); loading = false; }
+        cond.notify_one();
+        worker.join();
     }
     error_if_not(scene, "scene is nullptr");
     
-    image_filename = (args.object_element("image_filename").as_string() != "") ?
-        args.object_element("image_filename").as_string() :
-        scene_filename.substr(0,scene_filename.size()-5)+".png";
+    image_filename = (imagename != "") ? imagename : scene_filename.substr(0,scene_filename.size()-5)+".png";
     
     if(not args.object_element("resolution").is_null()) {
         scene->image_height = args.object_element("resolution").as_int();
         scene->image_width = scene->camera->width * scene->image_height / scene->camera->height;
     }
     
-    subdivide(scene);
+    scene->draw_lod = args.object_element("lod").as_bool();
+    scene->draw_lod_pixels = args.object_element("lod_pixels").as_float();
+    scene->draw_lod_fade = args.object_element("lod_fade").as_bool();
+    scene->draw_gpu_tessellation = args.object_element("gpu_tessellation").as_bool();
+    scene->draw_tess_pixels = args.object_element("tess_pixels").as_float();
     
+    set_scene_values(scene, scene_values);
+}
+
+// set scene to a copy of the sweep base scene with the values of a sweep image
+void load_sweep_scene(int job) {
+    delete scene;
+    scene = clone_scene(sweep_base);
+    set_scene_values(scene, sweep_jobs[job]);
+}
+
+// numbered image filename of a frame of a sequence
+string frame_filename(int frame) {
+    return tostring("%s.%05d.png", image_filename.substr(0,image_filename.size()-4).c_str(), frame);
+}
+
+// set the camera of a frame of the turntable sequence: start orbits once around its focus point
+// over turntable_frames frames, with dolly and pan interpolated linearly between keyframes
+void set_turntable_frame(Camera* camera, const Camera& start, int frame) {
+    auto key = TurntableKey();
+    if(not turntable_keys.empty()) {
+        auto next = std::upper_bound(turntable_keys.begin(), turntable_keys.end(), frame,
+                                     [](int frame, const TurntableKey& key) { return frame < key.frame; });
+        if(next == turntable_keys.begin()) key = *next;
+        else if(next == turntable_keys.end()) key = turntable_keys.back();
+        else {
+            auto& prev = *(next-1);
+            auto t = float(frame - prev.frame) / float(next->frame - prev.frame);
+            key.dolly = prev.dolly*(1-t) + next->dolly*t;
+            key.pan = prev.pan*(1-t) + next->pan*t;
+        }
+    }
+    *camera = start;
+    set_view_turntable(camera, 2*pif*frame/turntable_frames, 0, key.dolly, key.pan.x, key.pan.y);
+}
+
+// load turntable keyframes from a file of "frame dolly pan_x pan_y" lines
+void load_turntable_keys(const string& filename) {
+    std::ifstream file(filename.c_str());
+    error_if_not(file.good(), "cannot open file: %s\n", filename.c_str());
+    auto line = string();
+    while(std::getline(file, line)) {
+        std::istringstream values(line);
+        auto key = TurntableKey();
+        if(values >> key.frame >> key.dolly >> key.pan.x >> key.pan.y) turntable_keys.push_back(key);
+    }
+    std::stable_sort(turntable_keys.begin(), turntable_keys.end(),
+                     [](const TurntableKey& a, const TurntableKey& b) { return a.frame < b.frame; });
+}
+
+// render the images of the sweep with the cpu rasterizer, concurrently, each from its own copy of the
+// scene loaded once, to numbered images
+void cpu_render_sweep(const pair<string,string>& job, const jsonvalue& args) {
+    load_scene(job.first, job.second, args);
+    scene->draw_gpu_tessellation = false;
+    parallel_for(sweep_jobs.size(), [&](int i) {
+        auto sweep_scene = clone_scene(scene);
+        set_scene_values(sweep_scene, sweep_jobs[i]);
+        subdivide(sweep_scene);
+        sweep_scene->camera->width = (sweep_scene->camera->height * sweep_scene->image_width) / sweep_scene->image_height;
+        write_png(frame_filename(i), raster_scene(sweep_scene), true);
+        delete sweep_scene;
+        message("rendered %s (%s)\n", frame_filename(i).c_str(), sweep_description(sweep_jobs[i]).c_str());
+    });
+}
+
+// render (scene, image) filename pairs with the cpu rasterizer, without OpenGL
+void cpu_render(const vector<pair<string,string>>& jobs, const jsonvalue& args) {
+    if(not sweep_jobs.empty()) { cpu_render_sweep(jobs[0], args); return; }
+    for(auto& job : jobs) {
+        load_scene(job.first, job.second, args);
+        // splines and surfaces are always subdivided on the cpu here
+        scene->draw_gpu_tessellation = false;
+        subdivide(scene);
+        scene->camera->width = (scene->camera->height * scene->image_width) / scene->image_height;
+        if(not turntable_frames) write_png(image_filename, raster_scene(scene), true);
+        else {
+            // each frame is compressed in the background while the next one renders
+            auto start = *scene->camera;
+            for(auto frame : range(turntable_frames)) {
+                set_turntable_frame(scene->camera, start, frame);
+                write_png_async(frame_filename(frame), raster_scene(scene), true);
+            }
+        }
+        message("rendered %s\n", image_filename.c_str());
+    }
+    write_png_async_wait();
+}
+
+// main function
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "02_model", "view scene",
+            {  {"resolution",     "r", "image resolution", typeid(int),    true,  jsonvalue() },
+               {"headless",       "H", "render offscreen, write the image and exit", typeid(bool), true, jsonvalue(false) },
+               {"cpu",            "c", "render on the cpu without OpenGL, write the image and exit", typeid(bool), true, jsonvalue(false) },
+               {"turntable",      "",  "render this many frames orbiting the camera to image.#####.png", typeid(int), true, jsonvalue(0) },
+               {"turntable_keys", "",  "file with turntable camera keyframes, one \"frame dolly pan_x pan_y\" per line", typeid(string), true, jsonvalue("") },
+               {"png_profile",    "",  "png encoding profile: fast, default or max", typeid(string), true, jsonvalue("default") },
+               {"png_parallel",   "",  "deflate png images in parallel chunks of rows", typeid(bool), true, jsonvalue(false) },
+               {"mip_cache",      "",  "cache texture mip levels next to their images", typeid(bool), true, jsonvalue(false) },
+               {"cache_mb",       "",  "memory budget in MB of the textures and meshes cached between scenes", typeid(int), true, jsonvalue(1024) },
+               {"queue",          "q", "file with more scenes to render headless or on the cpu, one \"scene [image]\" per line", typeid(string), true, jsonvalue("") },
+               {"lod",            "l", "select subdivision levels of detail per frame", typeid(bool), true, jsonvalue(false) },
+               {"lod_pixels",     "",  "screen area in pixels targeted for each face by lod selection", typeid(float), true, jsonvalue(16.0) },
+               {"lod_fade",       "",  "cross-fade between levels of detail", typeid(bool), true, jsonvalue(false) },
+               {"gpu_tessellation", "t", "tessellate splines and surfaces on the gpu", typeid(bool), true, jsonvalue(false) },
+               {"tess_pixels",    "",  "screen length in pixels targeted for gpu tessellated edges", typeid(float), true, jsonvalue(8.0) },
+               {"set",            "",  "set a scene value as path=value, with a json value (e.g. meshes.*.subdivision_catmullclark_level=2)", typeid(vector<string>), true, jsonvalue(jsonvalue::array()) },
+               {"sweep",          "",  "render a numbered image for each value of a scene value, given as path=value,value,... or path=first:last[:step] (every combination of several sweeps)", typeid(vector<string>), true, jsonvalue(jsonvalue::array()) }  },
+            {  {"scene_filename", "",  "scene filename",   typeid(string), false, jsonvalue("scene.json")},
+               {"image_filename", "",  "image filename",   typeid(string), true,  jsonvalue("")}  }
+        });
+    
+    // collect the scenes to render, the command line one first and then the queued ones
+    auto jobs = vector<pair<string,string>>();
+    jobs.push_back({args.object_element("scene_filename").as_string(), args.object_element("image_filename").as_string()});
+    auto queue_filename = args.object_element("queue").as_string();
+    if(queue_filename != "") {
+        std::ifstream queue(queue_filename.c_str());
+        error_if_not(queue.good(), "cannot open file: %s\n", queue_filename.c_str());
+        auto line = string();
+        while(std::getline(queue, line)) {
+            std::istringstream names(line);
+            auto job = pair<string,string>();
+            if(names >> job.first) { names >> job.second; jobs.push_back(job); }
+        }
+    }
+    
+    // scene values set on every scene, and sweeps of the scene values of a single scene
+    for(auto& value : args.object_element("set").as_array_ref()) scene_values.push_back(parse_scene_value(value.as_string()));
+    auto sweeps = vector<vector<SceneValue>>();
+    for(auto& sweep : args.object_element("sweep").as_array_ref()) sweeps.push_back(parse_sweep(sweep.as_string()));
+    if(not sweeps.empty()) {
+        error_if_not(jobs.size() == 1 and not args.object_element("turntable").as_int(), "a sweep renders single images of a single scene");
+        sweep_jobs = expand_sweeps(sweeps);
+    }
+    
+    // png encoding used by all image writes
+    auto png_profile = args.object_element("png_profile").as_string();
+    error_if_not(png_profile == "fast" or png_profile == "default" or png_profile == "max", "unknown png profile: %s\n", png_profile.c_str());
+    png_options.profile = (png_profile == "fast") ? png_fast : (png_profile == "max") ? png_max : png_default;
+    png_options.parallel = args.object_element("png_parallel").as_bool();
+    texture_mip_cache = args.object_element("mip_cache").as_bool();
+    asset_cache_budget = size_t(max(0, args.object_element("cache_mb").as_int())) << 20;
+    
+    // turntable sequences are rendered offscreen
+    turntable_frames = args.object_element("turntable").as_int();
+    auto keys_filename = args.object_element("turntable_keys").as_string();
+    if(keys_filename != "") load_turntable_keys(keys_filename);
+    
+    // render on the cpu and exit
+    if(args.object_element("cpu").as_bool()) {
+        cpu_render(jobs, args);
+        return 0;
+    }
+    
+    // render offscreen and exit
+    if(args.object_element("headless").as_bool() or turntable_frames) {
+        headless(jobs, args);
+        return 0;
+    }
+    error_if_not(jobs.size() == 1, "a queue of scenes can only be rendered headless or on the cpu");
+    error_if_not(sweep_jobs.empty(), "a sweep can only be rendered headless or on the cpu");
+    
+    load_scene(jobs[0].first, jobs[0].second, args);
+    
+    // subdivision runs in uiloop, once gpu tessellation support is known
     uiloop();
 }
 
@@ -716,25 +1057,124 @@ int main(int argc, char** argv) {
 int gl_program_id         = 0;  // OpenGL program handle
 int gl_vertex_shader_id   = 0;  // OpenGL vertex shader handle
 int gl_fragment_shader_id = 0;  // OpenGL fragment shader handle
-map<image3f*,int> gl_texture_id;// OpenGL texture handles
+map<texture*,int> gl_texture_id;// OpenGL texture handles
+int gl_tess_spline_program_id  = 0; // OpenGL bezier spline tessellation program handle
+int gl_tess_surface_program_id = 0; // OpenGL surface tessellation program handle
+int gl_current_program_id = 0;  // program the uniform binding utilities bind to
+
+unsigned int gl_vertex_buffer_id  = 0;  // OpenGL shared vertex buffer handle
+unsigned int gl_element_buffer_id = 0;  // OpenGL shared element buffer handle
+int gl_mesh_frame_location        = -1; // location of the mesh_frame uniform
+int gl_instanced_location         = -1; // location of the instanced uniform
+int gl_lod_fading_location        = -1; // location of the lod_fading uniform
+int gl_lod_fade_location          = -1; // location of the lod_fade uniform
+int gl_lod_fade_out_location      = -1; // location of the lod_fade_out uniform
 
 bool save      = false;         // whether to start the save loop
+bool record    = false;         // whether to capture every frame
+int record_frame = 0;           // index of the next recorded frame
 bool wireframe = false;         // display as wireframe
+bool instancing = false;        // whether instanced drawing is supported
+bool culling   = true;          // cull meshes outside the view frustum
+int lod_fade_frames = 8;        // number of frames of a level of detail cross-fade
+
+// vertex layout of the shared vertex buffer
+struct DrawVertex {
+    vec3f pos;                  // vertex position
+    vec3f norm;                 // vertex normal
+    vec2f texcoord;             // vertex texture coordinate
+};
+
+// element ranges of a mesh merged into the shared buffers;
+// ranges are (offset, count) of indices into the shared element buffer
+struct DrawRanges {
+    vec2i       triangles;      // triangle indices range
+    vec2i       quads;          // quad indices range
+    vec2i       edges;          // wireframe edge indices range
+    vec2i       lines;          // line and spline control polygon indices range
+    vec2i       patches;        // bezier control points or surface cage indices range, tessellated on the gpu
+};
+
+// draw list entry: a mesh and its levels of detail merged into the shared buffers
+struct DrawItem {
+    Mesh*       mesh = nullptr; // mesh (frame, material and bounds)
+    Surface*    surface = nullptr;  // surface tessellated on the gpu from the mesh cage (bounds)
+    vector<DrawRanges> lods;    // ranges of each level of detail, coarsest first and mesh last
+    int         lod = 0;        // level of detail selected this frame
+    int         lod_prev = -1;  // level of detail being faded out (<0 if not fading)
+    float       lod_fade = 1;   // cross-fade progress from lod_prev to lod
+    bool        visible = true; // whether the mesh survived culling this frame
+    bool        baked = false;  // whether the mesh frame is baked into its vertices (drawn with the identity frame)
+};
+
+// per-instance data of an instance buffer
+struct DrawInstance {
+    mat4f       frame;          // instance frame (transposed, so rows are the matrix columns)
+    float       radius = 1;     // instance radius
+};
+
+// instanced draw group: surfaces sharing tessellation and material,
+// drawn as instances of a unit radius prototype mesh
+struct DrawInstances {
+    DrawItem            item;           // prototype mesh in the shared buffers
+    vector<Surface*>    surfaces;       // instanced surfaces
+    unsigned int        buffer_id = 0;  // OpenGL instance buffer handle
+    int                 visible = 0;    // number of instances in the buffer that survived culling
+    vector<vec2i>       lod_instances;  // (offset, count) of the visible instances of each level of detail
+};
+
+vector<DrawItem> draw_list;     // meshes to draw, sorted by material state
+vector<DrawInstances> draw_instances;   // instanced surface groups
+set<Surface*> instanced_surfaces;       // surfaces of the instanced groups, not tessellated on their own
+
+// frame capture in flight in a pixel buffer of the capture ring
+struct CaptureSlot {
+    unsigned int    buffer_id = 0;  // OpenGL pixel pack buffer handle
+    int             size = 0;       // allocated buffer size in bytes
+    string          filename;       // image filename (empty if the slot is free)
+    int             width = 0;      // image width
+    int             height = 0;     // image height
+    int             frame = 0;      // frame the read back was started at
+};
+
+const int capture_ring_size = 3;    // captures in flight, each mapped capture_ring_size-1 frames after its read back
+vector<CaptureSlot> capture_ring;   // capture pixel buffers, reused round robin
+int capture_next = 0;               // next slot of the capture ring
+int capture_frames = 0;             // frames rendered, used to time the mapping of captures
 
 void init_shaders();            // initialize the shaders
 void init_textures();           // initialize the textures
+void init_tessellation();       // initialize the gpu tessellation programs if supported
+void init_draw_list();          // merge meshes into shared buffers and sort them by material
+void init_draw_instances();     // group repeated surfaces for instanced drawing (before subdividing the scene)
 void shade();                   // render the scene with OpenGL
-void _shade_mesh(Mesh* mesh);
+void _use_program(int program);
+void _bind_scene(const mat4f& camera_frame_inverse, const mat4f& camera_projection);
+void _bind_material(Material* mat);
+void _draw_patches(const mat4f& camera_frame_inverse, const mat4f& camera_projection);
+void _draw_ranges(GLenum mode, vector<DrawItem>::iterator begin,
+                  vector<DrawItem>::iterator end, vec2i DrawRanges::*range);
+void _draw_lod(const DrawRanges& lod, int instances);
+void _draw_instances(DrawInstances& group);
+void _cull(const mat4f& view_projection);
+int _select_lod(const vector<DrawRanges>& lods, const vec3f& center, float radius);
+void _update_lod(DrawItem& item, int lod);
+void capture_frame(const string& filename);    // start an asynchronous read back of the frame
+void capture_update(bool flush = false);        // queue finished captures for writing
+void _capture_finish(CaptureSlot& slot);
 void character_callback(GLFWwindow* window, unsigned int key);  // ...
                                 // glfw callback for character input
-void _bind_texture(string name_map, string name_on, image3f* txt, int pos); // ...
+void _bind_texture(string name_map, string name_on, texture* txt, int pos); // ...
                                 // utility to bind texture parameters for shaders
                                 // uses texture name, texture_on name, texture pointer and texture unit position
 
 // glfw callback for character input
 void character_callback(GLFWwindow* window, unsigned int key) {
     if(key == 's') save = true;
+    if(key == 'r') record = not record;
     if(key == 'w') wireframe = not wireframe;
+    if(key == 'c') culling = not culling;
+    if(key == 'l') scene->draw_lod = not scene->draw_lod;
 }
 
 // uiloop
@@ -758,7 +1198,11 @@ void uiloop() {
     error_if_not(GLEW_OK == ok_glew, "glew init error");
     
     init_shaders();
+    init_tessellation();
+    init_draw_instances();
+    subdivide(scene, instanced_surfaces);
     init_textures();
+    init_draw_list();
     
     auto mouse_last_x = -1.0;
     auto mouse_last_y = -1.0;
@@ -781,22 +1225,229 @@ void uiloop() {
             mouse_last_y = y;
         } else { mouse_last_x = -1; mouse_last_y = -1; }
         
-        if(save) {
-            auto image = image3f(scene->image_width,scene->image_height);
-            glReadPixels(0, 0, scene->image_width, scene->image_height, GL_RGB, GL_FLOAT, &image.at(0,0));
-            write_png(image_filename, image, true);
+        // capture frames asynchronously, compressing them on a background thread
+        if(save or record) {
+            auto filename = (record) ? frame_filename(record_frame++) : image_filename;
+            capture_frame(filename);
             save = false;
         }
+        capture_update();
         
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
     
+    // write pending captures
+    capture_update(true);
+    write_png_async_wait();
+    
     glfwDestroyWindow(window);
     
     glfwTerminate();
 }
 
+// start an asynchronous read back of the frame into the next pixel buffer of the capture ring
+void capture_frame(const string& filename) {
+    auto width = scene->image_width;
+    auto height = scene->image_height;
+    
+    // without pixel buffers, read back synchronously but still compress in the background
+    if(not (GLEW_VERSION_2_1 or GLEW_ARB_pixel_buffer_object)) {
+        auto pixels = vector<unsigned char>(width*height*4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        write_png_async(filename, std::move(pixels), width, height, true);
+        return;
+    }
+    
+    // grab the next slot, finishing it if still in flight
+    if(capture_ring.empty()) capture_ring.resize(capture_ring_size);
+    auto& slot = capture_ring[capture_next];
+    capture_next = (capture_next+1) % capture_ring.size();
+    if(not slot.filename.empty()) _capture_finish(slot);
+    
+    // read back into the pixel buffer, returning without waiting for the transfer
+    if(not slot.buffer_id) glGenBuffers(1, &slot.buffer_id);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer_id);
+    if(slot.size != width*height*4) {
+        slot.size = width*height*4;
+        glBufferData(GL_PIXEL_PACK_BUFFER, slot.size, nullptr, GL_STREAM_READ);
+    }
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.filename = filename;
+    slot.width = width;
+    slot.height = height;
+    slot.frame = capture_frames;
+}
+
+// queue the captures started capture_ring_size-1 frames ago (all of them if flush) for writing
+void capture_update(bool flush) {
+    for(auto& slot : capture_ring) {
+        if(slot.filename.empty()) continue;
+        if(flush or capture_frames - slot.frame >= capture_ring_size-1) _capture_finish(slot);
+    }
+    capture_frames ++;
+}
+
+// map a capture pixel buffer and queue a copy of its pixels for writing, freeing the slot
+void _capture_finish(CaptureSlot& slot) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer_id);
+    auto data = (unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    error_if_not(data, "cannot map capture buffer");
+    auto pixels = vector<unsigned char>(data, data + slot.width*slot.height*4);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    write_png_async(slot.filename, std::move(pixels), slot.width, slot.height, true);
+    slot.filename = "";
+}
+
+// offscreen framebuffers for headless rendering: a (multisampled) one to render into
+// and, when multisampled, a single sampled one to resolve into and read back from
+struct HeadlessTarget {
+    unsigned int    framebuffer_id = 0;         // OpenGL framebuffer handle
+    unsigned int    color_id = 0;               // OpenGL color renderbuffer handle
+    unsigned int    depth_id = 0;               // OpenGL depth renderbuffer handle
+    unsigned int    resolve_framebuffer_id = 0; // OpenGL resolve framebuffer handle
+    unsigned int    resolve_color_id = 0;       // OpenGL resolve color renderbuffer handle
+    int             width = 0;                  // framebuffer width
+    int             height = 0;                 // framebuffer height
+    int             samples = 0;                // framebuffer samples
+};
+
+// create an offscreen OpenGL context with EGL, needing neither a window nor a display server
+void _init_headless_context() {
+#ifdef USE_EGL
+    // prefer the surfaceless platform, falling back to the default display
+    auto display = EGL_NO_DISPLAY;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(get_platform_display) display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+    if(display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    error_if_not(display != EGL_NO_DISPLAY and eglInitialize(display, nullptr, nullptr), "egl init error");
+    error_if_not(eglBindAPI(EGL_OPENGL_API), "egl opengl api error");
+    
+    // create a context without surface, since rendering goes to framebuffer objects
+    EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = nullptr;
+    EGLint configs = 0;
+    eglChooseConfig(display, config_attribs, &config, 1, &configs);
+    auto context = eglCreateContext(display, (configs) ? config : nullptr, EGL_NO_CONTEXT, nullptr);
+    error_if_not(context != EGL_NO_CONTEXT, "egl context error");
+    error_if_not(eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context), "egl context error");
+#else
+    error("headless rendering requires EGL");
+#endif
+}
+
+// (re)allocate the headless framebuffers if their size or samples change
+void _resize_headless_target(HeadlessTarget& target, int width, int height, int samples) {
+    if(target.framebuffer_id and target.width == width and target.height == height and target.samples == samples) return;
+    if(not target.framebuffer_id) {
+        glGenFramebuffers(1, &target.framebuffer_id);
+        glGenRenderbuffers(1, &target.color_id);
+        glGenRenderbuffers(1, &target.depth_id);
+        glGenFramebuffers(1, &target.resolve_framebuffer_id);
+        glGenRenderbuffers(1, &target.resolve_color_id);
+    }
+    target.width = width;
+    target.height = height;
+    target.samples = samples;
+    
+    auto storage = [width,height](unsigned int id, GLenum format, int samples) {
+        glBindRenderbuffer(GL_RENDERBUFFER, id);
+        if(samples > 1) glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, width, height);
+        else glRenderbufferStorage(GL_RENDERBUFFER, format, width, height);
+    };
+    storage(target.color_id, GL_RGBA8, samples);
+    storage(target.depth_id, GL_DEPTH_COMPONENT24, samples);
+    storage(target.resolve_color_id, GL_RGBA8, 1);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, target.resolve_framebuffer_id);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.resolve_color_id);
+    error_if_not(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE, "framebuffer error");
+    glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer_id);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color_id);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth_id);
+    error_if_not(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE, "framebuffer error");
+}
+
+// render scenes offscreen and write their images, reusing the context, shaders,
+// textures and framebuffers between jobs; read backs overlap with the following jobs
+void headless(const vector<pair<string,string>>& jobs, const jsonvalue& args) {
+    _init_headless_context();
+    
+    glewExperimental = GL_TRUE;
+    auto ok_glew = glewInit();
+    error_if_not(GLEW_OK == ok_glew, "glew init error");
+    
+    init_shaders();
+    
+    // textures evicted from the asset cache between jobs are freed on the gpu too
+    asset_cache_evicted = [](texture* txt) {
+        auto id = gl_texture_id.find(txt);
+        if(id == gl_texture_id.end()) return;
+        auto gl_id = (unsigned int)id->second;
+        glDeleteTextures(1, &gl_id);
+        gl_texture_id.erase(id);
+    };
+    
+    // a sweep renders its images from copies of the scene, loaded once
+    if(not sweep_jobs.empty()) {
+        load_scene(jobs[0].first, jobs[0].second, args);
+        sweep_base = scene;
+        scene = nullptr;
+    }
+    
+    auto target = HeadlessTarget();
+    auto count = (sweep_base) ? (int)sweep_jobs.size() : (int)jobs.size();
+    for(auto j : range(count)) {
+        // load and prepare the scene
+        if(sweep_base) load_sweep_scene(j);
+        else load_scene(jobs[j].first, jobs[j].second, args);
+        auto filename = (sweep_base) ? frame_filename(j) : image_filename;
+        init_tessellation();
+        init_draw_instances();
+        subdivide(scene, instanced_surfaces);
+        init_textures();
+        init_draw_list();
+        
+        _resize_headless_target(target, scene->image_width, scene->image_height, scene->image_samples);
+        scene->camera->width = (scene->camera->height * scene->image_width) / scene->image_height;
+        if(scene->image_samples > 1) glEnable(GL_MULTISAMPLE);
+        else glDisable(GL_MULTISAMPLE);
+        
+        // render each frame of the sequence, or the single image; the capture ring overlaps
+        // reading back and compressing a frame with rendering the next ones
+        auto start = *scene->camera;
+        for(auto frame : range(max(1,turntable_frames))) {
+            if(turntable_frames) set_turntable_frame(scene->camera, start, frame);
+            
+            // render into the offscreen framebuffer
+            glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer_id);
+            shade();
+            
+            // resolve samples and capture the image
+            if(target.samples > 1) {
+                glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.resolve_framebuffer_id);
+                glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, target.width, target.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, target.resolve_framebuffer_id);
+            }
+            capture_frame((turntable_frames) ? frame_filename(frame) : filename);
+            capture_update();
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            error_if_glerror();
+        }
+        if(sweep_base) message("rendered %s (%s)\n", filename.c_str(), sweep_description(sweep_jobs[j]).c_str());
+        else message("rendered %s\n", image_filename.c_str());
+    }
+    
+    // write pending captures
+    capture_update(true);
+    write_png_async_wait();
+}
+
 // initialize the shaders
 void init_shaders() {
     // load shader code from files
@@ -833,6 +1484,8 @@ void init_shaders() {
     glBindAttribLocation(gl_program_id, 0, "vertex_pos");
     glBindAttribLocation(gl_program_id, 1, "vertex_norm");
     glBindAttribLocation(gl_program_id, 2, "vertex_texcoord");
+    glBindAttribLocation(gl_program_id, 3, "instance_frame");   // uses locations 3 to 6
+    glBindAttribLocation(gl_program_id, 7, "instance_radius");
 
     // link program
     glLinkProgram(gl_program_id);
@@ -840,51 +1493,121 @@ void init_shaders() {
     // check if program is valid
     error_if_glerror();
     error_if_program_not_valid(gl_program_id);
+    
+    // cache locations of the uniforms set for every draw
+    gl_mesh_frame_location = glGetUniformLocation(gl_program_id,"mesh_frame");
+    gl_instanced_location = glGetUniformLocation(gl_program_id,"instanced");
+    gl_lod_fading_location = glGetUniformLocation(gl_program_id,"lod_fading");
+    gl_lod_fade_location = glGetUniformLocation(gl_program_id,"lod_fade");
+    gl_lod_fade_out_location = glGetUniformLocation(gl_program_id,"lod_fade_out");
 }
 
 // initialize the textures
 void init_textures() {
     // grab textures from scene
     auto textures = get_textures(scene);
+    // float formats are stored as floats if supported, and half floats are uploaded as is if supported
+    auto float_formats = GLEW_VERSION_3_0 or GLEW_ARB_texture_float;
+    auto half_pixels = GLEW_VERSION_3_0 or GLEW_ARB_half_float_pixel;
+    // rows of 8-bit and half float textures are not padded to 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     // foreach texture
-    for(auto texture : textures) {
+    for(auto txt : textures) {
         // if already in the gl_texture_id map, skip
-        if(gl_texture_id.find(texture) != gl_texture_id.end()) continue;
+        if(gl_texture_id.find(txt) != gl_texture_id.end()) continue;
         // gen texture id
         unsigned int id = 0;
         glGenTextures(1, &id);
         // set id to the gl_texture_id map for later use
-        gl_texture_id[texture] = id;
+        gl_texture_id[txt] = id;
         // bind texture
         glBindTexture(GL_TEXTURE_2D, id);
         // set texture filtering parameters
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
-        // load texture data
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-                     texture->width(), texture->height(),
-                     0, GL_RGB, GL_FLOAT, texture->data());
+        // mip levels are built with the texture, so all of them are uploaded instead of generated
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, txt->levels()-1);
+        // load texture data of each level in its storage format
+        for(auto l : range(txt->levels())) {
+            if(txt->format == rgb8_format) {
+                glTexImage2D(GL_TEXTURE_2D, l, GL_RGB8, txt->width(l), txt->height(l),
+                             0, GL_RGB, GL_UNSIGNED_BYTE, txt->data(l));
+            } else if(txt->format == rgb16f_format and half_pixels) {
+                glTexImage2D(GL_TEXTURE_2D, l, (float_formats) ? GL_RGB16F : GL_RGBA, txt->width(l), txt->height(l),
+                             0, GL_RGB, GL_HALF_FLOAT, txt->data(l));
+            } else if(txt->format == rgb16f_format) {
+                auto pixels = txt->to_image3f(l);
+                glTexImage2D(GL_TEXTURE_2D, l, (float_formats) ? GL_RGB16F : GL_RGBA, txt->width(l), txt->height(l),
+                             0, GL_RGB, GL_FLOAT, pixels.data());
+            } else {
+                glTexImage2D(GL_TEXTURE_2D, l, (float_formats) ? GL_RGB32F : GL_RGBA, txt->width(l), txt->height(l),
+                             0, GL_RGB, GL_FLOAT, txt->data(l));
+            }
+        }
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 }
 
+// compile a shader from a file, checking it is valid
+int _load_shader(GLenum type, const string& filename) {
+    auto code = load_text_file(filename.c_str());
+    auto codes = (char *)code.c_str();
+    auto shader_id = glCreateShader(type);
+    glShaderSource(shader_id,1,(const char**)&codes,nullptr);
+    glCompileShader(shader_id);
+    error_if_glerror();
+    error_if_shader_not_valid(shader_id);
+    return shader_id;
+}
+
+// link a tessellation program sharing the control point vertex shader, control shader and fragment shader
+int _link_tess_program(int vertex_shader_id, int control_shader_id, int evaluation_shader_id) {
+    auto program_id = glCreateProgram();
+    glAttachShader(program_id,vertex_shader_id);
+    glAttachShader(program_id,control_shader_id);
+    glAttachShader(program_id,evaluation_shader_id);
+    glAttachShader(program_id,gl_fragment_shader_id);
+    glBindAttribLocation(program_id, 0, "vertex_pos");
+    glLinkProgram(program_id);
+    error_if_glerror();
+    error_if_program_not_valid(program_id);
+    return program_id;
+}
+
+// initialize the gpu tessellation programs if supported, otherwise fall back to cpu subdivision
+// catmull-clark meshes are always subdivided on the cpu
+void init_tessellation() {
+    if(not scene->draw_gpu_tessellation) return;
+    if(not GLEW_VERSION_4_0) {
+        message("gpu tessellation not supported: subdividing on the cpu\n");
+        scene->draw_gpu_tessellation = false;
+        return;
+    }
+    if(gl_tess_spline_program_id) return;
+    auto vertex_shader_id = _load_shader(GL_VERTEX_SHADER, "model_tess_vertex.glsl");
+    auto control_shader_id = _load_shader(GL_TESS_CONTROL_SHADER, "model_tess_control.glsl");
+    auto spline_shader_id = _load_shader(GL_TESS_EVALUATION_SHADER, "model_tess_spline.glsl");
+    auto surface_shader_id = _load_shader(GL_TESS_EVALUATION_SHADER, "model_tess_surface.glsl");
+    gl_tess_spline_program_id = _link_tess_program(vertex_shader_id, control_shader_id, spline_shader_id);
+    gl_tess_surface_program_id = _link_tess_program(vertex_shader_id, control_shader_id, surface_shader_id);
+}
 
 // utility to bind texture parameters for shaders
 // uses texture name, texture_on name, texture pointer and texture unit position
-void _bind_texture(string name_map, string name_on, image3f* txt, int pos) {
+void _bind_texture(string name_map, string name_on, texture* txt, int pos) {
     // if txt is not null
     if(txt) {
         // set texture on boolean parameter to true
-        glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_TRUE);
+        glUniform1i(glGetUniformLocation(gl_current_program_id,name_on.c_str()),GL_TRUE);
         // activate a texture unit at position pos
         glActiveTexture(GL_TEXTURE0+pos);
         // bind texture object to it from gl_texture_id map
         glBindTexture(GL_TEXTURE_2D, gl_texture_id[txt]);
         // set texture parameter to the position pos
-        glUniform1i(glGetUniformLocation(gl_program_id, name_map.c_str()), pos);
+        glUniform1i(glGetUniformLocation(gl_current_program_id, name_map.c_str()), pos);
     } else {
         // set texture on boolean parameter to false
-        glUniform1i(glGetUniformLocation(gl_program_id,name_on.c_str()),GL_FALSE);
+        glUniform1i(glGetUniformLocation(gl_current_program_id,name_on.c_str()),GL_FALSE);
         // activate a texture unit at position pos
         glActiveTexture(GL_TEXTURE0+pos);
         // set zero as the texture id
@@ -892,6 +1615,206 @@ void _bind_texture(string name_map, string name_on, image3f* txt, int pos) {
     }
 }
 
+// compare material state, used to sort the draw list so that equal materials are adjacent
+bool _material_less(Material* a, Material* b) {
+    if(a->kd_txt != b->kd_txt) return a->kd_txt < b->kd_txt;
+    if(a->ks_txt != b->ks_txt) return a->ks_txt < b->ks_txt;
+    if(a->norm_txt != b->norm_txt) return a->norm_txt < b->norm_txt;
+    for(auto i : range(3)) if(a->kd[i] != b->kd[i]) return a->kd[i] < b->kd[i];
+    for(auto i : range(3)) if(a->ks[i] != b->ks[i]) return a->ks[i] < b->ks[i];
+    return a->n < b->n;
+}
+
+// whether two materials bind the same shader state
+bool _material_equal(Material* a, Material* b) {
+    return a == b or (not _material_less(a,b) and not _material_less(b,a));
+}
+
+// compare frames, used to sort the draw list so that equal frames are adjacent
+bool _frame_less(const frame3f& a, const frame3f& b) {
+    auto fa = &a.o.x, fb = &b.o.x;
+    for(auto i : range(12)) if(fa[i] != fb[i]) return fa[i] < fb[i];
+    return false;
+}
+
+// compare the state a draw item is drawn with: material, then baked items, then frame
+bool _draw_item_less(const DrawItem& a, const DrawItem& b) {
+    if(not _material_equal(a.mesh->mat, b.mesh->mat)) return _material_less(a.mesh->mat, b.mesh->mat);
+    if(a.baked != b.baked) return a.baked;
+    return not a.baked and _frame_less(a.mesh->frame, b.mesh->frame);
+}
+
+// whether two draw items are drawn with the same material and frame, so that they are drawn together
+bool _draw_item_equal(const DrawItem& a, const DrawItem& b) {
+    return _material_equal(a.mesh->mat, b.mesh->mat) and a.baked == b.baked and (a.baked or a.mesh->frame == b.mesh->frame);
+}
+
+// append the indices of n elements of mesh data to the shared element array rebasing them by base
+// returns the (offset, count) range of the appended indices
+vec2i _append_elements(vector<int>& elements, const int* indices, int count, int base) {
+    auto range = vec2i((int)elements.size(), count);
+    for(auto i = 0; i < count; i ++) elements.push_back(base + indices[i]);
+    return range;
+}
+
+// merge a mesh into the shared vertex and element arrays, returning its ranges
+// (if frame is set, vertices are transformed to world space by it)
+DrawRanges _append_mesh(Mesh* mesh, vector<DrawVertex>& vertices, vector<int>& elements, const frame3f* frame = nullptr) {
+    ERROR_IF_NOT(mesh, "mesh is null");
+    auto base = (int)vertices.size();
+    for(auto i : range(mesh->pos.size())) {
+        auto vertex = DrawVertex();
+        vertex.pos = (frame) ? transform_point(*frame, mesh->pos[i]) : mesh->pos[i];
+        if(not mesh->norm.empty()) vertex.norm = (frame) ? transform_normal(*frame, mesh->norm[i]) : mesh->norm[i];
+        if(not mesh->texcoord.empty()) vertex.texcoord = mesh->texcoord[i];
+        vertices.push_back(vertex);
+    }
+    // wireframe edges are computed once here instead of every frame
+    auto edges = EdgeMap(mesh->triangle, mesh->quad).edges();
+    // spline segments left for gpu tessellation are drawn as patches, the others as their control polygons
+    auto lines = mesh->line;
+    auto patches = vector<vec4i>();
+    if(mesh->subdivision_bezier_level) patches = mesh->spline;
+    else {
+        for(auto segment : mesh->spline) {
+            lines.push_back({segment.x,segment.y});
+            lines.push_back({segment.y,segment.z});
+            lines.push_back({segment.z,segment.w});
+        }
+    }
+    auto ranges = DrawRanges();
+    ranges.triangles = _append_elements(elements, (int*)mesh->triangle.data(), mesh->triangle.size()*3, base);
+    ranges.quads = _append_elements(elements, (int*)mesh->quad.data(), mesh->quad.size()*4, base);
+    ranges.edges = _append_elements(elements, (int*)edges.data(), edges.size()*2, base);
+    ranges.lines = _append_elements(elements, (int*)lines.data(), lines.size()*2, base);
+    ranges.patches = _append_elements(elements, (int*)patches.data(), patches.size()*4, base);
+    return ranges;
+}
+
+// merge the mesh of a draw item and its levels of detail into the shared arrays, starting at the finest level
+// (the geometry of instances is their shape's; baked items are merged in world space)
+void _append_draw_item(DrawItem& item, vector<DrawVertex>& vertices, vector<int>& elements) {
+    auto shape = mesh_shape(item.mesh);
+    auto frame = (item.baked) ? &item.mesh->frame : nullptr;
+    item.lods.clear();
+    for(auto lod : shape->_lods) item.lods.push_back(_append_mesh(lod, vertices, elements, frame));
+    auto base = (int)vertices.size();
+    item.lods.push_back(_append_mesh(shape, vertices, elements, frame));
+    item.lod = item.lods.size()-1;
+    // gpu tessellated surfaces draw their cage as a single patch
+    if(item.surface) {
+        auto cage = vec4i(0,1,2,3);
+        item.lods.back().patches = _append_elements(elements, &cage.x, 4, base);
+    }
+}
+
+// compare the tessellation, up to frame and radius, and the material state of undisplaced surfaces,
+// so that surfaces drawn as instances of the same prototype are equivalent
+bool _surface_instance_less(Surface* a, Surface* b) {
+    if(a->isquad != b->isquad) return a->isquad < b->isquad;
+    if(a->subdivision_level != b->subdivision_level) return a->subdivision_level < b->subdivision_level;
+    if(a->subdivision_smooth != b->subdivision_smooth) return a->subdivision_smooth < b->subdivision_smooth;
+    return _material_less(a->mat, b->mat);
+}
+
+// group repeated surfaces for instanced drawing, tessellating a single prototype for each group
+void init_draw_instances() {
+    for(auto& group : draw_instances) glDeleteBuffers(1, &group.buffer_id);
+    draw_instances.clear();
+    instanced_surfaces.clear();
+    
+    // check for instanced arrays support
+    instancing = GLEW_VERSION_3_3 or (GLEW_ARB_instanced_arrays and GLEW_ARB_draw_instanced);
+    if(not instancing) return;
+    
+    // group surfaces sharing tessellation and material state, in the order they first appear
+    auto group_index = map<Surface*,int,bool(*)(Surface*,Surface*)>(_surface_instance_less);
+    for(auto surf : scene->surfaces) {
+        if(scene->draw_gpu_tessellation and surface_gpu_tessellation(surf)) continue;
+        if(surf->displacement_depth != 0) continue;
+        auto found = group_index.find(surf);
+        if(found != group_index.end()) { draw_instances[found->second].surfaces.push_back(surf); continue; }
+        group_index[surf] = (int)draw_instances.size();
+        draw_instances.push_back(DrawInstances());
+        draw_instances.back().surfaces.push_back(surf);
+    }
+    
+    // surfaces that are not repeated are drawn from the draw list
+    draw_instances.erase(std::remove_if(draw_instances.begin(), draw_instances.end(), [](const DrawInstances& group) {
+        return group.surfaces.size() < 2;
+    }), draw_instances.end());
+    
+    // foreach group
+    for(auto& group : draw_instances) {
+        instanced_surfaces.insert(group.surfaces.begin(), group.surfaces.end());
+        
+        // tessellate a unit radius prototype at the origin
+        auto prototype = Surface(*group.surfaces.front());
+        prototype.frame = identity_frame3f;
+        prototype.radius = 1;
+        subdivide_surface(&prototype, scene->arena, scene->draw_lod);
+        group.item.mesh = prototype._display_mesh;
+        
+        // allocate the instance buffer, filled with the visible instances every frame
+        glGenBuffers(1, &group.buffer_id);
+        glBindBuffer(GL_ARRAY_BUFFER, group.buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, group.surfaces.size()*sizeof(DrawInstance), nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    error_if_glerror();
+}
+
+// merge meshes into shared buffers and sort them by material
+void init_draw_list() {
+    // collect meshes and surface display meshes, skipping instanced surfaces
+    draw_list.clear();
+    for(auto mesh : scene->meshes) { draw_list.push_back(DrawItem()); draw_list.back().mesh = mesh; }
+    for(auto surf : scene->surfaces) {
+        if(instanced_surfaces.count(surf)) continue;
+        draw_list.push_back(DrawItem());
+        draw_list.back().mesh = surf->_display_mesh;
+        if(scene->draw_gpu_tessellation and surface_gpu_tessellation(surf)) draw_list.back().surface = surf;
+    }
+
+    // static meshes have their frame baked into their vertices, so that all of those sharing a material
+    // are drawn together; instances share their shape geometry and gpu patches are tessellated in their
+    // frame, so those keep it
+    for(auto& item : draw_list) {
+        item.baked = not item.mesh->shape and not item.surface and not item.mesh->subdivision_bezier_level;
+    }
+    
+    // sort by material state so that each material is bound once, and by frame within a material
+    std::stable_sort(draw_list.begin(), draw_list.end(), _draw_item_less);
+
+    // merge vertex data and rebased indices into shared arrays
+    auto vertices = vector<DrawVertex>();
+    auto elements = vector<int>();
+    // instances of a shape share the ranges of its geometry, merged once
+    auto shape_lods = map<Mesh*,vector<DrawRanges>>();
+    for(auto& item : draw_list) {
+        auto shape = item.mesh->shape;
+        if(shape and shape_lods.count(shape)) {
+            item.lods = shape_lods[shape];
+            item.lod = item.lods.size()-1;
+            continue;
+        }
+        _append_draw_item(item, vertices, elements);
+        if(shape) shape_lods[shape] = item.lods;
+    }
+    for(auto& group : draw_instances) _append_draw_item(group.item, vertices, elements);
+
+    // upload shared buffers
+    if(not gl_vertex_buffer_id) glGenBuffers(1, &gl_vertex_buffer_id);
+    if(not gl_element_buffer_id) glGenBuffers(1, &gl_element_buffer_id);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_vertex_buffer_id);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(DrawVertex), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl_element_buffer_id);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements.size()*sizeof(int), elements.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    error_if_glerror();
+}
+
 // render the scene with OpenGL
 void shade() {
     // enable depth test
@@ -910,89 +1833,325 @@ void shade() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
     // enable program
-    glUseProgram(gl_program_id);
+    _use_program(gl_program_id);
+    
+    // bind camera and lights - use frame_to_matrix_inverse and frustum_matrix
+    auto camera_frame_inverse = frame_to_matrix_inverse(scene->camera->frame);
+    auto camera_projection = frustum_matrix(-scene->camera->dist*scene->camera->width/2, scene->camera->dist*scene->camera->width/2,
+                                            -scene->camera->dist*scene->camera->height/2, scene->camera->dist*scene->camera->height/2,
+                                            scene->camera->dist,10000);
+    _bind_scene(camera_frame_inverse, camera_projection);
     
-    // bind camera's position, inverse of frame and projection
-    // use frame_to_matrix_inverse and frustum_matrix
-    glUniform3fv(glGetUniformLocation(gl_program_id,"camera_pos"),
+    // cull meshes and instances against the view frustum
+    _cull(camera_projection * camera_frame_inverse);
+    
+    // bind shared buffers and set up vertex attributes once for all meshes
+    auto vertex_pos_location = glGetAttribLocation(gl_program_id, "vertex_pos");
+    auto vertex_norm_location = glGetAttribLocation(gl_program_id, "vertex_norm");
+    auto vertex_texcoord_location = glGetAttribLocation(gl_program_id, "vertex_texcoord");
+    glBindBuffer(GL_ARRAY_BUFFER, gl_vertex_buffer_id);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gl_element_buffer_id);
+    glEnableVertexAttribArray(vertex_pos_location);
+    glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, sizeof(DrawVertex), (void*)offsetof(DrawVertex,pos));
+    glEnableVertexAttribArray(vertex_norm_location);
+    glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, sizeof(DrawVertex), (void*)offsetof(DrawVertex,norm));
+    glEnableVertexAttribArray(vertex_texcoord_location);
+    glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, sizeof(DrawVertex), (void*)offsetof(DrawVertex,texcoord));
+
+    // foreach run of draw items sharing material and frame (all baked items of a material are one run)
+    Material* bound_mat = nullptr;
+    for(auto begin = draw_list.begin(); begin != draw_list.end(); ) {
+        auto end = begin + 1;
+        auto visible = begin->visible;
+        while(end != draw_list.end() and _draw_item_equal(*end, *begin)) { visible = visible or end->visible; end++; }
+        
+        // skip runs with no visible mesh
+        if(not visible) { begin = end; continue; }
+
+        // bind material only when it changes
+        if(not bound_mat or not _material_equal(bound_mat, begin->mesh->mat)) {
+            bound_mat = begin->mesh->mat;
+            _bind_material(bound_mat);
+        }
+
+        // bind mesh frame - use frame_to_matrix
+        auto frame = (begin->baked) ? identity_frame3f : begin->mesh->frame;
+        glUniformMatrix4fv(gl_mesh_frame_location,1,true,&frame_to_matrix(frame)[0][0]);
+
+        // draw triangles and quads
+        if(not wireframe) {
+            _draw_ranges(GL_TRIANGLES, begin, end, &DrawRanges::triangles);
+            _draw_ranges(GL_QUADS, begin, end, &DrawRanges::quads);
+        } else _draw_ranges(GL_LINES, begin, end, &DrawRanges::edges);
+
+        // draw line sets
+        _draw_ranges(GL_LINES, begin, end, &DrawRanges::lines);
+
+        // draw items changing level of detail one at a time, with both levels dithered
+        for(auto item = begin; item != end; item ++) {
+            if(not item->visible or item->lod_prev < 0) continue;
+            glUniform1i(gl_lod_fading_location, GL_TRUE);
+            glUniform1f(gl_lod_fade_location, item->lod_fade);
+            glUniform1i(gl_lod_fade_out_location, GL_FALSE);
+            _draw_lod(item->lods[item->lod], 0);
+            glUniform1i(gl_lod_fade_out_location, GL_TRUE);
+            _draw_lod(item->lods[item->lod_prev], 0);
+            glUniform1i(gl_lod_fading_location, GL_FALSE);
+        }
+
+        begin = end;
+    }
+
+    // draw instanced surface groups
+    for(auto& group : draw_instances) _draw_instances(group);
+    
+    // draw splines and surfaces tessellated on the gpu
+    if(scene->draw_gpu_tessellation) _draw_patches(camera_frame_inverse, camera_projection);
+
+    // disable vertex attribute arrays and unbind buffers
+    glDisableVertexAttribArray(vertex_pos_location);
+    glDisableVertexAttribArray(vertex_norm_location);
+    glDisableVertexAttribArray(vertex_texcoord_location);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// enable a program and make it the target of the uniform binding utilities
+void _use_program(int program) {
+    glUseProgram(program);
+    gl_current_program_id = program;
+}
+
+// bind camera's position, inverse of frame and projection, ambient and lights
+void _bind_scene(const mat4f& camera_frame_inverse, const mat4f& camera_projection) {
+    glUniform3fv(glGetUniformLocation(gl_current_program_id,"camera_pos"),
                  1, &scene->camera->frame.o.x);
-    glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_frame_inverse"),
-                       1, true, &frame_to_matrix_inverse(scene->camera->frame)[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"camera_projection"),
-                       1, true, &frustum_matrix(-scene->camera->dist*scene->camera->width/2, scene->camera->dist*scene->camera->width/2,
-                                                -scene->camera->dist*scene->camera->height/2, scene->camera->dist*scene->camera->height/2,
-                                                scene->camera->dist,10000)[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(gl_current_program_id,"camera_frame_inverse"),
+                       1, true, &camera_frame_inverse.x.x);
+    glUniformMatrix4fv(glGetUniformLocation(gl_current_program_id,"camera_projection"),
+                       1, true, &camera_projection.x.x);
     
     // bind ambient and number of lights
-    glUniform3fv(glGetUniformLocation(gl_program_id,"ambient"),1,&scene->ambient.x);
-    glUniform1i(glGetUniformLocation(gl_program_id,"lights_num"),scene->lights.size());
+    glUniform3fv(glGetUniformLocation(gl_current_program_id,"ambient"),1,&scene->ambient.x);
+    glUniform1i(glGetUniformLocation(gl_current_program_id,"lights_num"),scene->lights.size());
     
     // foreach light
     auto count = 0;
     for(auto light : scene->lights) {
         // bind light position and internsity (create param name with tostring)
-        glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_pos[%d]",count).c_str()),
+        glUniform3fv(glGetUniformLocation(gl_current_program_id,tostring("light_pos[%d]",count).c_str()),
                      1, &light->frame.o.x);
-        glUniform3fv(glGetUniformLocation(gl_program_id,tostring("light_intensity[%d]",count).c_str()),
+        glUniform3fv(glGetUniformLocation(gl_current_program_id,tostring("light_intensity[%d]",count).c_str()),
                      1, &light->intensity.x);
         count++;
     }
-    
-    // foreach mesh
-    for(auto mesh : scene->meshes) {
-        _shade_mesh(mesh);
+}
+
+// bind material kd, ks, n and texture params
+void _bind_material(Material* mat) {
+    ERROR_IF_NOT(mat, "material is null");
+    glUniform3fv(glGetUniformLocation(gl_current_program_id,"material_kd"),1,&mat->kd.x);
+    glUniform3fv(glGetUniformLocation(gl_current_program_id,"material_ks"),1,&mat->ks.x);
+    glUniform1f(glGetUniformLocation(gl_current_program_id,"material_n"),mat->n);
+
+    // bind texture params (txt_on, sampler)
+    _bind_texture("material_kd_txt",   "material_kd_txt_on",   mat->kd_txt,   0);
+    _bind_texture("material_ks_txt",   "material_ks_txt_on",   mat->ks_txt,   1);
+    _bind_texture("material_norm_txt", "material_norm_txt_on", mat->norm_txt, 2);
+}
+
+// frustum planes (a,b,c,d) of a view projection matrix, with inside points having a*x+b*y+c*z+d >= 0
+std::array<vec4f,6> _frustum_planes(const mat4f& m) {
+    auto planes = std::array<vec4f,6>{{ m.w+m.x, m.w-m.x, m.w+m.y, m.w-m.y, m.w+m.z, m.w-m.z }};
+    for(auto& p : planes) p = p / length(vec3f(p.x,p.y,p.z));
+    return planes;
+}
+
+// whether a bounding sphere is (at least partially) inside the frustum planes
+bool _frustum_overlaps(const std::array<vec4f,6>& planes, const vec3f& center, float radius) {
+    if(radius < 0) return false;
+    for(auto& p : planes) if(dot(vec3f(p.x,p.y,p.z),center) + p.w < -radius) return false;
+    return true;
+}
+
+// select the coarsest level of detail whose faces cover at most draw_lod_pixels pixels each,
+// estimating screen coverage from the projected bounding sphere
+int _select_lod(const vector<DrawRanges>& lods, const vec3f& center, float radius) {
+    auto finest = (int)lods.size()-1;
+    if(not scene->draw_lod or finest <= 0 or radius <= 0) return finest;
+    // depth along the view direction, clamped to the image plane when the camera is inside the bounds
+    auto depth = max(dot(scene->camera->frame.o - center, scene->camera->frame.z), scene->camera->dist);
+    auto radius_pixels = radius * scene->image_height / (scene->camera->height * depth);
+    auto area = pif * radius_pixels * radius_pixels;
+    for(auto l : range(finest)) {
+        // about half of the faces face the camera
+        auto faces = lods[l].triangles.y / 3 + lods[l].quads.y / 4;
+        if(faces * 0.5f * scene->draw_lod_pixels >= area) return l;
     }
-    
-    for(auto surf : scene->surfaces) {
-        _shade_mesh(surf->_display_mesh);
+    return finest;
+}
+
+// switch a draw item to a level of detail, starting or advancing its cross-fade
+void _update_lod(DrawItem& item, int lod) {
+    if(lod != item.lod) {
+        item.lod_prev = (scene->draw_lod_fade) ? item.lod : -1;
+        item.lod_fade = 0;
+        item.lod = lod;
+    } else if(item.lod_prev >= 0) {
+        item.lod_fade += 1.0f / lod_fade_frames;
+        if(item.lod_fade >= 1) { item.lod_prev = -1; item.lod_fade = 1; }
     }
 }
 
-void _shade_mesh(Mesh* mesh) {
-    // bind material kd, ks, n
-    ERROR_IF_NOT(mesh, "mesh is null");
-    glUniform3fv(glGetUniformLocation(gl_program_id,"material_kd"),1,&mesh->mat->kd.x);
-    glUniform3fv(glGetUniformLocation(gl_program_id,"material_ks"),1,&mesh->mat->ks.x);
-    glUniform1f(glGetUniformLocation(gl_program_id,"material_n"),mesh->mat->n);
-    
-    // bind texture params (txt_on, sampler)
-    _bind_texture("material_kd_txt",   "material_kd_txt_on",   mesh->mat->kd_txt,   0);
-    _bind_texture("material_ks_txt",   "material_ks_txt_on",   mesh->mat->ks_txt,   1);
-    _bind_texture("material_norm_txt", "material_norm_txt_on", mesh->mat->norm_txt, 2);
-    
-    // bind mesh frame - use frame_to_matrix
-    glUniformMatrix4fv(glGetUniformLocation(gl_program_id,"mesh_frame"),1,true,&frame_to_matrix(mesh->frame)[0][0]);
+// cull draw items and instances against the view frustum and select their levels of detail,
+// refilling the instance buffers
+void _cull(const mat4f& view_projection) {
+    auto planes = _frustum_planes(view_projection);
+    for(auto& item : draw_list) {
+        // gpu tessellated surfaces are bounded by the surface, not its cage
+        auto center = zero3f;
+        auto radius = 0.0f;
+        if(item.surface) {
+            update_bounds(item.surface);
+            center = item.surface->_bsphere_center;
+            radius = item.surface->_bsphere_radius;
+        } else {
+            update_bounds(item.mesh);
+            center = item.mesh->_bsphere_center;
+            radius = item.mesh->_bsphere_radius;
+        }
+        item.visible = not culling or _frustum_overlaps(planes, center, radius);
+        _update_lod(item, _select_lod(item.lods, center, radius));
+    }
+    for(auto& group : draw_instances) {
+        // bucket visible instances by level of detail
+        auto levels = vector<vector<DrawInstance>>(group.item.lods.size());
+        for(auto surf : group.surfaces) {
+            update_bounds(surf);
+            if(culling and not _frustum_overlaps(planes, surf->_bsphere_center, surf->_bsphere_radius)) continue;
+            auto instance = DrawInstance();
+            instance.frame = transpose(frame_to_matrix(surf->frame));
+            instance.radius = surf->radius;
+            levels[_select_lod(group.item.lods, surf->_bsphere_center, surf->_bsphere_radius)].push_back(instance);
+        }
+        // store instances sorted by level of detail
+        auto instances = vector<DrawInstance>();
+        group.lod_instances.clear();
+        for(auto& level : levels) {
+            group.lod_instances.push_back(vec2i(instances.size(), level.size()));
+            instances.insert(instances.end(), level.begin(), level.end());
+        }
+        group.visible = instances.size();
+        if(instances.empty()) continue;
+        glBindBuffer(GL_ARRAY_BUFFER, group.buffer_id);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size()*sizeof(DrawInstance), instances.data());
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    // enable vertex attributes arrays and set up pointers to the mesh data
-    auto vertex_pos_location = glGetAttribLocation(gl_program_id, "vertex_pos");
-    auto vertex_norm_location = glGetAttribLocation(gl_program_id, "vertex_norm");
-    auto vertex_texcoord_location = glGetAttribLocation(gl_program_id, "vertex_texcoord");
-    glEnableVertexAttribArray(vertex_pos_location);
-    glVertexAttribPointer(vertex_pos_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->pos[0].x);
-    glEnableVertexAttribArray(vertex_norm_location);
-    glVertexAttribPointer(vertex_norm_location, 3, GL_FLOAT, GL_FALSE, 0, &mesh->norm[0].x);
-    if(not mesh->texcoord.empty()) {
-        glEnableVertexAttribArray(vertex_texcoord_location);
-        glVertexAttribPointer(vertex_texcoord_location, 2, GL_FLOAT, GL_FALSE, 0, &mesh->texcoord[0].x);
+// draw one element range of the selected level of detail of each draw item in [begin,end)
+// with a single (multi-)draw call, skipping items that are cross-fading
+void _draw_ranges(GLenum mode, vector<DrawItem>::iterator begin,
+                  vector<DrawItem>::iterator end, vec2i DrawRanges::*range) {
+    auto counts = vector<GLsizei>();
+    auto offsets = vector<const GLvoid*>();
+    for(auto item = begin; item != end; item ++) {
+        if(not item->visible or item->lod_prev >= 0) continue;
+        auto r = item->lods[item->lod].*range;
+        if(not r.y) continue;
+        counts.push_back(r.y);
+        offsets.push_back((const GLvoid*)(r.x*sizeof(int)));
     }
-    else glVertexAttrib2f(vertex_texcoord_location, 0, 0);
-    
-    // draw triangles and quads
+    if(counts.empty()) return;
+    if(counts.size() == 1) glDrawElements(mode, counts[0], GL_UNSIGNED_INT, offsets[0]);
+    else glMultiDrawElements(mode, counts.data(), GL_UNSIGNED_INT, offsets.data(), counts.size());
+}
+
+// draw all primitives of a level of detail, as instances if instances > 0
+void _draw_lod(const DrawRanges& lod, int instances) {
+    auto draw = [instances](GLenum mode, vec2i r) {
+        if(not r.y) return;
+        auto offset = (const GLvoid*)(r.x*sizeof(int));
+        if(instances) glDrawElementsInstanced(mode, r.y, GL_UNSIGNED_INT, offset, instances);
+        else glDrawElements(mode, r.y, GL_UNSIGNED_INT, offset);
+    };
     if(not wireframe) {
-        if(mesh->triangle.size()) glDrawElements(GL_TRIANGLES, mesh->triangle.size()*3, GL_UNSIGNED_INT, &mesh->triangle[0].x);
-        if(mesh->quad.size()) glDrawElements(GL_QUADS, mesh->quad.size()*4, GL_UNSIGNED_INT, &mesh->quad[0].x);
-    } else {
-        auto edges = EdgeMap(mesh->triangle, mesh->quad).edges();
-        glDrawElements(GL_LINES, edges.size()*2, GL_UNSIGNED_INT, &edges[0].x);
+        draw(GL_TRIANGLES, lod.triangles);
+        draw(GL_QUADS, lod.quads);
+    } else draw(GL_LINES, lod.edges);
+    draw(GL_LINES, lod.lines);
+}
+
+// draw the patches of the visible draw items with the gpu tessellation programs,
+// with tessellation factors computed from their screen size
+void _draw_patches(const mat4f& camera_frame_inverse, const mat4f& camera_projection) {
+    glPatchParameteri(GL_PATCH_VERTICES, 4);
+    if(wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    for(auto program : { gl_tess_spline_program_id, gl_tess_surface_program_id }) {
+        auto surfaces = (program == gl_tess_surface_program_id);
+        _use_program(program);
+        _bind_scene(camera_frame_inverse, camera_projection);
+        glUniform1i(glGetUniformLocation(program,"tess_surface"), surfaces);
+        glUniform1f(glGetUniformLocation(program,"tess_pixels"), scene->draw_tess_pixels);
+        glUniform2f(glGetUniformLocation(program,"viewport_size"), scene->image_width, scene->image_height);
+        auto mesh_frame_location = glGetUniformLocation(program,"mesh_frame");
+        for(auto& item : draw_list) {
+            auto patches = item.lods[item.lod].patches;
+            if(not item.visible or not patches.y or (item.surface != nullptr) != surfaces) continue;
+            _bind_material(item.mesh->mat);
+            glUniformMatrix4fv(mesh_frame_location,1,true,&frame_to_matrix(item.mesh->frame)[0][0]);
+            if(item.surface) {
+                glUniform1i(glGetUniformLocation(program,"tess_sphere"), not item.surface->isquad);
+                glUniform1f(glGetUniformLocation(program,"tess_radius"), item.surface->radius);
+            }
+            glDrawElements(GL_PATCHES, patches.y, GL_UNSIGNED_INT, (const GLvoid*)(patches.x*sizeof(int)));
+        }
     }
-    
-    // draw line sets
-    if(not mesh->line.empty()) glDrawElements(GL_LINES, mesh->line.size()*2, GL_UNSIGNED_INT, mesh->line.data());
-    for(auto segment : mesh->spline) glDrawElements(GL_LINE_STRIP, 4, GL_UNSIGNED_INT, &segment);
-    
-    // disable vertex attribute arrays
-    glDisableVertexAttribArray(vertex_pos_location);
-    glDisableVertexAttribArray(vertex_norm_location);
-    if(not mesh->texcoord.empty()) glDisableVertexAttribArray(vertex_texcoord_location);
+    if(wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    _use_program(gl_program_id);
 }
 
+// draw an instanced surface group, with instance attributes read from its instance buffer
+void _draw_instances(DrawInstances& group) {
+    if(not group.visible) return;
+    
+    // bind material and switch the vertex shader to instance frames
+    _bind_material(group.item.mesh->mat);
+    glUniform1i(gl_instanced_location, GL_TRUE);
+    
+    // set up instance attributes, advancing once per instance (mat4 uses four locations)
+    auto instance_frame_location = glGetAttribLocation(gl_program_id, "instance_frame");
+    auto instance_radius_location = glGetAttribLocation(gl_program_id, "instance_radius");
+    glBindBuffer(GL_ARRAY_BUFFER, group.buffer_id);
+    for(auto i : range(4)) {
+        glEnableVertexAttribArray(instance_frame_location+i);
+        glVertexAttribDivisor(instance_frame_location+i, 1);
+    }
+    glEnableVertexAttribArray(instance_radius_location);
+    glVertexAttribDivisor(instance_radius_location, 1);
+    
+    // foreach level of detail, draw its instances with one call per primitive type
+    for(auto l : range(group.item.lods.size())) {
+        auto instances = group.lod_instances[l];
+        if(not instances.y) continue;
+        // point the instance attributes at the first instance of the level
+        auto base = instances.x*sizeof(DrawInstance);
+        for(auto i : range(4)) {
+            glVertexAttribPointer(instance_frame_location+i, 4, GL_FLOAT, GL_FALSE, sizeof(DrawInstance),
+                                  (void*)(base+offsetof(DrawInstance,frame)+i*sizeof(vec4f)));
+        }
+        glVertexAttribPointer(instance_radius_location, 1, GL_FLOAT, GL_FALSE, sizeof(DrawInstance),
+                              (void*)(base+offsetof(DrawInstance,radius)));
+        _draw_lod(group.item.lods[l], instances.y);
+    }
+    
+    // reset instance attributes and restore the vertex buffer
+    for(auto i : range(4)) {
+        glVertexAttribDivisor(instance_frame_location+i, 0);
+        glDisableVertexAttribArray(instance_frame_location+i);
+    }
+    glVertexAttribDivisor(instance_radius_location, 0);
+    glDisableVertexAttribArray(instance_radius_location);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_vertex_buffer_id);
+    glUniform1i(gl_instanced_location, GL_FALSE);
+}
@@ -0,0 +1,27 @@
+#include "scene.h"
+
+// converts a json mesh to a binary mesh, that scenes reference with "binary_mesh"
+int main(int argc, char** argv) {
+    auto args = parse_cmdline(argc, argv,
+        { "mesh2bin", "convert json meshes to binary meshes",
+            {  },
+            {  {"json_filename",   "", "json mesh filename",   typeid(string), false, jsonvalue("mesh.json")},
+               {"binary_filename", "", "binary mesh filename (defaults to the json filename with a .bmesh extension)", typeid(string), true, jsonvalue("")}  }
+        });
+    
+    auto json_filename = args.object_element("json_filename").as_string();
+    auto binary_filename = args.object_element("binary_filename").as_string();
+    if(binary_filename == "") {
+        auto ext = json_filename.rfind(".");
+        binary_filename = ((ext == string::npos) ? json_filename : json_filename.substr(0,ext)) + ".bmesh";
+    }
+    
+    auto mesh = load_json_mesh(json_filename);
+    auto mat = mesh->mat;
+    if(mat->kd_txt or mat->ks_txt or mat->kr_txt or mat->norm_txt or mat->ke_txt)
+        message("warning: textures of %s are not kept in binary meshes, set them in the scene material\n", json_filename.c_str());
+    save_binary_mesh(binary_filename, mesh);
+    message("converted %s to %s: %d vertices, %d triangles, %d quads\n", json_filename.c_str(), binary_filename.c_str(),
+            (int)mesh->pos.size(), (int)mesh->triangle.size(), (int)mesh->quad.size());
+    return 0;
+}
@@ -9,8 +9,24 @@
 #include <stdio.h>
 #include <cstdarg>
 #include <fstream>
+#include <sstream>
 #include <cstdio>
 #include <typeinfo>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <cstdint>
 
 // bringing stand libraray objects in scope
 using std::string;
@@ -59,6 +75,151 @@ struct range {
     iterator end() { return iterator(max); }
 };
 
+// whether the calling thread runs an index of a parallel_for with enough indices to keep all threads busy
+inline bool& _parallel_for_busy() { static thread_local bool busy = false; return busy; }
+
+// pool of hardware_concurrency-1 worker threads, started on first use and kept until exit, that run the
+// indices of parallel_for loops together with the threads that call them
+struct _ParallelPool {
+    // loop whose indices are taken in turn by the calling thread and the workers
+    struct Loop {
+        int                         n = 0;      // number of indices
+        std::atomic<int>            next;       // next index to run
+        std::atomic<int>            done;       // indices run
+        bool                        busy = false;   // whether the loop keeps all threads busy
+        std::function<void(int)>    f;          // loop body
+    };
+    
+    std::mutex                          mutex;      // guards loops and stop
+    std::condition_variable             work;       // signals new loops, or stop
+    std::condition_variable             finished;   // signals loops whose indices all ran
+    std::deque<std::shared_ptr<Loop>>   loops;      // loops with indices left to take
+    bool                                stop = false;   // whether the workers exit
+    vector<std::thread>                 threads;    // workers
+    
+    _ParallelPool() {
+        auto workers = std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+        while((int)threads.size() < workers) threads.push_back(std::thread([this]() { _work(); }));
+    }
+    ~_ParallelPool() {
+        { std::lock_guard<std::mutex> lock(mutex); stop = true; }
+        work.notify_all();
+        for(auto& thread : threads) thread.join();
+    }
+    
+    // runs f(i) for each i in [0,n) on the calling thread and the workers, returning once all ran
+    void run(int n, bool busy, const std::function<void(int)>& f) {
+        auto loop = std::make_shared<Loop>();
+        loop->n = n;
+        loop->next = 0;
+        loop->done = 0;
+        loop->busy = busy;
+        loop->f = f;
+        { std::lock_guard<std::mutex> lock(mutex); loops.push_back(loop); }
+        work.notify_all();
+        _run(loop);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return loop->done == n; });
+    }
+    
+    // runs indices of a loop until none is left, then drops it from the loops to take
+    void _run(const std::shared_ptr<Loop>& loop) {
+        _parallel_for_busy() = loop->busy;
+        for(auto i = loop->next++; i < loop->n; i = loop->next++) {
+            loop->f(i);
+            if(++loop->done == loop->n) { std::lock_guard<std::mutex> lock(mutex); finished.notify_all(); }
+        }
+        _parallel_for_busy() = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pos = std::find(loops.begin(), loops.end(), loop);
+        if(pos != loops.end()) loops.erase(pos);
+    }
+    
+    // worker thread: helps with the oldest loop that has indices left
+    void _work() {
+        while(true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            work.wait(lock, [&]() { return stop or not loops.empty(); });
+            if(stop) return;
+            auto loop = loops.front();
+            lock.unlock();
+            _run(loop);
+        }
+    }
+};
+
+// thread pool shared by all parallel_for loops
+inline _ParallelPool& _parallel_pool() { static _ParallelPool pool; return pool; }
+
+// runs f(i) for each i in [0,n) on the calling thread and the workers of a pool of hardware threads,
+// each taking the next index until none is left
+// (loops nested in a loop that keeps all threads busy run on the calling thread)
+template<typename F>
+inline void parallel_for(int n, const F& f) {
+    auto hardware_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    if(n <= 1 or hardware_threads == 1 or _parallel_for_busy()) { for(auto i : range(n)) f(i); return; }
+    _parallel_pool().run(n, n >= hardware_threads, [&f](int i) { f(i); });
+}
+
+// arena that allocates objects contiguously in large blocks and owns them, destroying all of them
+// at once, in reverse order of allocation, when cleared or destroyed (allocation is thread safe)
+struct Arena {
+    Arena() { }
+    ~Arena() { clear(); }
+    
+    // allocate an object constructed from args
+    template<typename T, typename ... Args>
+    T* make(Args&& ... args) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto object = new (_allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if(not std::is_trivially_destructible<T>::value) _destructors.push_back({object, [](void* p) { ((T*)p)->~T(); }});
+        return object;
+    }
+    
+    // destroy all objects and free their memory
+    void clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for(auto d = _destructors.rbegin(); d != _destructors.rend(); ++d) d->second(d->first);
+        _destructors.clear();
+        for(auto block : _blocks) ::operator delete(block);
+        _blocks.clear();
+        _next = _end = nullptr;
+        _size = 0;
+    }
+    
+    // bytes taken by the objects
+    size_t size() const { return _size; }
+    
+    std::mutex                          _mutex;             // guards allocation
+    vector<char*>                       _blocks;            // memory blocks
+    char*                               _next = nullptr;    // next free byte of the last block
+    char*                               _end = nullptr;     // end of the last block
+    size_t                              _size = 0;          // bytes taken by the objects
+    vector<pair<void*,void(*)(void*)>>  _destructors;       // objects to destroy, with their destructor
+    
+    static const size_t _block_size = 1 << 16;              // size of the memory blocks (larger objects get their own)
+    
+    // take size bytes aligned to align from the last block, starting a new block if they do not fit
+    void* _allocate(size_t size, size_t align) {
+        auto aligned = [align](char* p) { return (char*)(((uintptr_t)p + align-1) & ~(uintptr_t)(align-1)); };
+        auto object = aligned(_next);
+        if(not _next or object + size > _end) {
+            auto block_size = std::max(_block_size, size + align);
+            _blocks.push_back((char*)::operator new(block_size));
+            _next = _blocks.back();
+            _end = _next + block_size;
+            object = aligned(_next);
+        }
+        _next = object + size;
+        _size += size;
+        return object;
+    }
+    
+private:
+    Arena(const Arena&);                // not copyable
+    Arena& operator=(const Arena&);     // not copyable
+};
+
 // load a text file into a buffer
 inline string load_text_file(const char* filename) {
     auto text = string("");
@@ -18,6 +18,13 @@
 #define GLFW_INCLUDE_GLU
 #include "GLFW/glfw3.h"
 
+// offscreen contexts for headless rendering (defined by cmake when EGL is found)
+#ifdef USE_EGL
+#   define EGL_NO_X11
+#   include <EGL/egl.h>
+#   include <EGL/eglext.h>
+#endif
+
 
 #define GLS_CHECK_ERROR 1
 
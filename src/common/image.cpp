@@ -1,6 +1,182 @@
 #include "image.h"
 #include "lodepng.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// run f(y) for each image row, on parallel threads for blocks of rows
+template<typename F>
+static void _parallel_rows(int height, const F& f) {
+    const int block = 64;
+    parallel_for((height+block-1)/block, [&](int b) {
+        for(auto y : range(b*block, std::min(height,(b+1)*block))) f(y);
+    });
+}
+
+void gamma_inplace(const image3f_view& img, float gamma) {
+    _parallel_rows(img.height, [&](int j) {
+        auto values = &img.row(j)->x;
+        for(auto i : range(img.width*3)) values[i] = pow(values[i], gamma);
+    });
+}
+
+void scale_inplace(const image3f_view& img, float s) {
+    _parallel_rows(img.height, [&](int j) {
+        auto values = &img.row(j)->x;
+        for(auto i : range(img.width*3)) values[i] *= s;
+    });
+}
+
+// sums two rows of floats, four at a time
+static void _add_rows(const float* a, const float* b, float* sum, int n) {
+    auto k = 0;
+#ifdef __SSE2__
+    for(; k+4 <= n; k += 4) _mm_storeu_ps(sum+k, _mm_add_ps(_mm_loadu_ps(a+k), _mm_loadu_ps(b+k)));
+#endif
+    for(; k < n; k++) sum[k] = a[k]+b[k];
+}
+
+vector<image3f> make_mipmaps(const image3f& img) {
+    auto levels = vector<image3f>();
+    auto prev = &img;
+    while(prev->width() > 1 or prev->height() > 1) {
+        auto& src = *prev;
+        auto level = image3f(std::max(1,src.width()/2), std::max(1,src.height()/2));
+        _parallel_rows(level.height(), [&](int j) {
+            // the row sums are kept to be reused by the next row on this thread
+            static thread_local vector<float> sum;
+            sum.resize(src.width()*3);
+            _add_rows(&src.at(0,2*j).x, &src.at(0,std::min(2*j+1,src.height()-1)).x, sum.data(), src.width()*3);
+            for(auto i : range(level.width())) {
+                auto s0 = sum.data() + 2*i*3, s1 = sum.data() + std::min(2*i+1,src.width()-1)*3;
+                level.at(i,j) = vec3f(s0[0]+s1[0], s0[1]+s1[1], s0[2]+s1[2]) * 0.25f;
+            }
+        });
+        levels.push_back(std::move(level));
+        prev = &levels.back();
+    }
+    return levels;
+}
+
+// reads the levels below the first from a mip cache file, checking they have the expected sizes
+template<typename T>
+static bool _read_mip_levels(FILE* f, vector<image<T>>& levels) {
+    int count = 0;
+    if(fread(&count, sizeof(int), 1, f) != 1) return false;
+    for(auto l : range(1,count)) {
+        int size[2];
+        if(fread(size, sizeof(int), 2, f) != 2) return false;
+        if(size[0] != std::max(1,levels[l-1].width()/2) or size[1] != std::max(1,levels[l-1].height()/2)) return false;
+        auto level = image<T>(size[0],size[1]);
+        if(fread(level.data(), sizeof(T), level.width()*level.height(), f) != (size_t)(level.width()*level.height())) return false;
+        levels.push_back(std::move(level));
+    }
+    return levels.back().width() == 1 and levels.back().height() == 1;
+}
+
+// writes the levels below the first to a mip cache file
+template<typename T>
+static void _write_mip_levels(FILE* f, const vector<image<T>>& levels) {
+    int count = levels.size();
+    fwrite(&count, sizeof(int), 1, f);
+    for(auto l : range(1,count)) {
+        int size[2] = { levels[l].width(), levels[l].height() };
+        fwrite(size, sizeof(int), 2, f);
+        fwrite(levels[l].data(), sizeof(T), levels[l].width()*levels[l].height(), f);
+    }
+}
+
+// mip cache files hold a "MIP1" tag, the storage format, the level count and each level below
+// the first as its width, height and pixels; they are used only if not older than their source
+static bool _read_mip_cache(texture* txt, const string& filename, const string& source_filename) {
+    struct stat cache_stat, source_stat;
+    if(stat(filename.c_str(), &cache_stat) != 0) return false;
+    if(not source_filename.empty() and stat(source_filename.c_str(), &source_stat) == 0 and
+       cache_stat.st_mtime < source_stat.st_mtime) return false;
+    auto f = fopen(filename.c_str(), "rb");
+    if(not f) return false;
+    char tag[4]; int format = -1;
+    auto ok = fread(tag, 1, 4, f) == 4 and memcmp(tag, "MIP1", 4) == 0 and
+              fread(&format, sizeof(int), 1, f) == 1 and format == txt->format;
+    if(ok) {
+        switch(txt->format) {
+            case rgb8_format: ok = _read_mip_levels(f, txt->rgb8); break;
+            case rgb16f_format: ok = _read_mip_levels(f, txt->rgb16f); break;
+            default: ok = _read_mip_levels(f, txt->rgb32f); break;
+        }
+    }
+    fclose(f);
+    // a stale or partial cache leaves only the first level
+    if(not ok) { txt->rgb8.resize(std::min<size_t>(txt->rgb8.size(),1)); txt->rgb16f.resize(std::min<size_t>(txt->rgb16f.size(),1)); txt->rgb32f.resize(std::min<size_t>(txt->rgb32f.size(),1)); }
+    return ok;
+}
+
+static void _write_mip_cache(const texture* txt, const string& filename) {
+    auto f = fopen(filename.c_str(), "wb");
+    if(not f) { message("cannot write mip cache: %s\n", filename.c_str()); return; }
+    int format = txt->format;
+    fwrite("MIP1", 1, 4, f);
+    fwrite(&format, sizeof(int), 1, f);
+    switch(txt->format) {
+        case rgb8_format: _write_mip_levels(f, txt->rgb8); break;
+        case rgb16f_format: _write_mip_levels(f, txt->rgb16f); break;
+        default: _write_mip_levels(f, txt->rgb32f); break;
+    }
+    fclose(f);
+}
+
+void make_texture_mipmaps(texture* txt, const string& cache_filename, const string& source_filename) {
+    if(txt->levels() > 1) return;
+    if(not cache_filename.empty() and _read_mip_cache(txt, cache_filename, source_filename)) return;
+    // levels are filtered in floating point and converted back to the storage format
+    switch(txt->format) {
+        case rgb8_format: {
+            auto levels = make_mipmaps(txt->to_image3f());
+            for(auto& level : levels) txt->rgb8.push_back(convert_image<vec3ub>(level));
+        } break;
+        case rgb16f_format: {
+            auto levels = make_mipmaps(txt->to_image3f());
+            for(auto& level : levels) txt->rgb16f.push_back(convert_image<vec3h>(level));
+        } break;
+        default: {
+            auto levels = make_mipmaps(txt->rgb32f[0]);
+            for(auto& level : levels) txt->rgb32f.push_back(std::move(level));
+        } break;
+    }
+    if(not cache_filename.empty()) _write_mip_cache(txt, cache_filename);
+}
+
+// bilinear lookup of a mip level, with texel centers at half integers as in OpenGL
+static vec3f _lookup_level(const texture* txt, int l, const vec2f& uv, bool repeat) {
+    auto w = txt->width(l), h = txt->height(l);
+    auto s = uv.x*w-0.5f, t = uv.y*h-0.5f;
+    auto i = (int)floor(s), j = (int)floor(t);
+    auto fs = s-i, ft = t-j;
+    auto wrap = [repeat](int i, int n) { if(not repeat) return std::min(std::max(i,0),n-1); i %= n; return (i < 0) ? i+n : i; };
+    auto i0 = wrap(i,w), i1 = wrap(i+1,w);
+    auto j0 = wrap(j,h), j1 = wrap(j+1,h);
+    return (txt->at(i0,j0,l)*(1-fs) + txt->at(i1,j0,l)*fs)*(1-ft) +
+           (txt->at(i0,j1,l)*(1-fs) + txt->at(i1,j1,l)*fs)*ft;
+}
+
+vec3f lookup_texture(const texture* txt, const vec2f& uv, float lod, bool repeat) {
+    auto top = txt->levels()-1;
+    lod = std::min(std::max(lod,0.0f),(float)top);
+    auto l = (int)lod;
+    auto f = lod-l;
+    auto c = _lookup_level(txt, l, uv, repeat);
+    if(f > 0) c = c*(1-f) + _lookup_level(txt, l+1, uv, repeat)*f;
+    return c;
+}
+
 static void _read_pnm(const string& filename, char& type,
                int& width, int& height, int& nc,
                float& scale, unsigned char*& buffer) {
@@ -62,7 +238,47 @@ static void _read_pnm(const string& filename, char& type,
     fclose(f);
 }
 
+#ifndef _WIN32
+// read a little endian color PFM by mapping the file and copying its rows straight into the image,
+// applying the bottom-up row order of the file (and flipY) by row index; returns false if the file
+// is not such a PFM, leaving it to the generic reader
+static bool _read_pfm_mapped(const string& filename, bool flipY, image3f& img) {
+    auto fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    auto ok = fstat(fd, &st) == 0 and st.st_size > 0;
+    auto size = (ok) ? (size_t)st.st_size : 0;
+    auto data = (ok) ? (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : (const char*)MAP_FAILED;
+    close(fd);
+    if(data == MAP_FAILED) return false;
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+    
+    // header: "PF", width, height and a negative (little endian) scale, followed by one whitespace
+    auto header = string(data, std::min(size, size_t(256)));
+    int width = 0, height = 0, offset = 0; float scale = 0;
+    ok = sscanf(header.c_str(), "PF %d %d %f%n", &width, &height, &scale, &offset) == 3 and
+         scale < 0 and width > 0 and height > 0 and offset < (int)header.size() and
+         size >= offset + 1 + size_t(width)*height*sizeof(vec3f);
+    if(ok) {
+        auto pixels = data + offset + 1;
+        scale = abs(scale);
+        img = image3f(width, height);
+        _parallel_rows(height, [&](int r) {
+            auto row = &img.at(0, (flipY) ? r : height-1-r);
+            std::memcpy(row, pixels + size_t(r)*width*sizeof(vec3f), width*sizeof(vec3f));
+            if(scale != 1) { auto values = &row->x; for(auto i : range(width*3)) values[i] *= scale; }
+        });
+    }
+    munmap((void*)data, size);
+    return ok;
+}
+#endif
+
 image3f read_pnm(const string& filename, bool flipY) {
+#ifndef _WIN32
+    auto mapped = image3f();
+    if(_read_pfm_mapped(filename, flipY, mapped)) return mapped;
+#endif
     int width, height, nc; float scale; unsigned char* buffer; char type;
     _read_pnm(filename, type, width, height, nc, scale, buffer);
     if (not buffer) {
@@ -85,97 +301,514 @@ image3f read_pnm(const string& filename, bool flipY) {
     }
     if (buffer) delete [] buffer;
     
-    if(flipY) img = img.flipy();
+    if(flipY) flipy_inplace(img.view());
     
     return img;
 }
 
-static void _write_pnm(const char *filename, char type,
-                         int width, int height, int nc,
-                         bool ascii, unsigned char* buffer) {
-    FILE *f = fopen(filename, "wb");
-    error_if_not(f != 0, "failed to create image file %s", filename);
-    
-    string magic; 
-    int scale = -1; 
-    int ds = 0;
-    if(type == 'f' && nc == 1 && !ascii) { magic = "Pf"; scale = -1; 
-        ds = sizeof(float); }
-    else if(type == 'f' && nc == 3 && !ascii) { magic = "PF"; scale = -1; 
-        ds = sizeof(float); }
-    else if(type == 'B' && nc == 1 && !ascii) { magic = "P5"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 3 && !ascii) { magic = "P6"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 1 && ascii) { magic = "P2"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else if(type == 'B' && nc == 3 && ascii) { magic = "P3"; scale = 255; 
-        ds = sizeof(unsigned char); }
-    else error("unsupported image format");
-    
-    error_if_not(fprintf(f, "%s\n", magic.c_str()) > 0, "error writing file %s", filename);
-    error_if_not(fprintf(f, "%d %d\n", width, height) > 0, "error writing file %s", filename);
-    error_if_not(fprintf(f, "%d\n", scale) > 0, "error writing file %s", filename);
-    
-    if(!ascii) {
-        if(type == 'f') {
-            for(int j = height-1; j >= 0; j --) {
-                float* buf = (float*)buffer;
-                error_if_not((int)fwrite(buf + j*width*nc, ds, width*nc, f) == width*nc, "error writing file %s", filename);
+void write_pfm(const string& filename, const image3f& img, bool flipY) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    error_if_not(f != 0, "failed to create image file %s", filename.c_str());
+    error_if_not(fprintf(f, "PF\n%d %d\n%d\n", img.width(), img.height(), -1) > 0, "error writing file %s", filename.c_str());
+    // stream rows straight from the image, in the bottom-up order of the file
+    for(int r = 0; r < img.height(); r ++) {
+        auto row = &img.at(0, (flipY) ? r : img.height()-1-r);
+        error_if_not((int)fwrite(row, sizeof(vec3f), img.width(), f) == img.width(), "error writing file %s", filename.c_str());
+    }
+    fclose(f);
+}
+
+const int _transfer_levels = 4096;     // levels of [0,1] in the 8-bit encoding tables
+
+// lookup tables of the curves between linear values and 8-bit pixels, indexed by ImageTransfer
+struct _TransferTables {
+    float           decode[3][256];                 // 8-bit pixel to linear value
+    unsigned char   encode[3][_transfer_levels];    // linear value, quantized to _transfer_levels, to 8-bit pixel
+};
+
+// encoded value in [0,1] of a linear value in [0,1]
+static float _transfer_encode(float v, ImageTransfer transfer) {
+    if(transfer == srgb_transfer) return (v <= 0.0031308f) ? 12.92f*v : 1.055f*pow(v,1/2.4f)-0.055f;
+    if(transfer == gamma_transfer) return pow(v,1/2.2f);
+    return v;
+}
+
+// linear value in [0,1] of an encoded value in [0,1]
+static float _transfer_decode(float v, ImageTransfer transfer) {
+    if(transfer == srgb_transfer) return (v <= 0.04045f) ? v/12.92f : pow((v+0.055f)/1.055f,2.4f);
+    if(transfer == gamma_transfer) return pow(v,2.2f);
+    return v;
+}
+
+// transfer tables, built on first use
+static const _TransferTables& _transfer_tables() {
+    static auto tables = []() {
+        auto tables = new _TransferTables();
+        for(auto t : range(3)) {
+            for(auto i : range(256)) tables->decode[t][i] = _transfer_decode(i / 255.0f, (ImageTransfer)t);
+            for(auto i : range(_transfer_levels)) {
+                auto v = _transfer_encode(i / float(_transfer_levels-1), (ImageTransfer)t);
+                tables->encode[t][i] = (unsigned char)clamp(v*255+0.5f, 0.0f, 255.0f);
             }
-        } else {
-            error_if_not((int)fwrite(buffer, ds, width*height*nc, f) == width*height*nc, "error writing file %s", filename);
-        }
-    } else {
-        unsigned char* buf = (unsigned char*)buffer;
-        for(int i = 0; i < width*height*nc; i ++) {
-            int v = buf[i];
-            error_if_not(fprintf(f, "%d \n", v) != 0, "error writing file %s", filename);
         }
+        return tables;
+    }();
+    return *tables;
+}
+
+// quantize 4 pixels (12 channels) as (int)clamp(v*scale+offset,0,max)
+static void _quantize4(const float* v, float scale, float offset, float max, int* q) {
+#ifdef __SSE2__
+    auto vscale = _mm_set1_ps(scale), voffset = _mm_set1_ps(offset);
+    auto vmin = _mm_setzero_ps(), vmax = _mm_set1_ps(max);
+    for(auto k : range(3)) {
+        auto x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(v+k*4), vscale), voffset);
+        x = _mm_min_ps(_mm_max_ps(x, vmin), vmax);
+        _mm_storeu_si128((__m128i*)(q+k*4), _mm_cvttps_epi32(x));
     }
-    
-	fclose(f);
+#else
+    for(auto k : range(12)) q[k] = (int)clamp(v[k]*scale+offset, 0.0f, max);
+#endif
 }
 
-void write_pfm(const string& filename, const image3f& img, bool flipY) {
-    _write_pnm(filename.c_str(), 'f', img.width(), img.height(), 3, false,
-               (flipY)?(unsigned char*)img.flipy().data():(unsigned char*)img.data());
+// convert a row of floating point colors to packed 8-bit rgba pixels
+static void _encode_row(const vec3f* src, unsigned char* dst, int width, ImageTransfer transfer) {
+    // linear values are truncated, as they always were; other curves round to the nearest table level
+    auto table = (transfer == linear_transfer) ? nullptr : _transfer_tables().encode[transfer];
+    auto scale = (table) ? float(_transfer_levels-1) : 255.0f;
+    auto offset = (table) ? 0.5f : 0.0f;
+    auto max = (table) ? float(_transfer_levels-1) : 255.0f;
+    int q[12];
+    for(auto i = 0; i < width; i += 4) {
+        auto n = std::min(4, width-i);
+        if(n == 4) _quantize4(&src[i].x, scale, offset, max, q);
+        else for(auto k : range(n*3)) q[k] = (int)clamp((&src[i].x)[k]*scale+offset, 0.0f, max);
+        for(auto p : range(n)) {
+            auto out = dst + (i+p)*4;
+            for(auto c : range(3)) out[c] = (table) ? table[q[p*3+c]] : (unsigned char)q[p*3+c];
+            out[3] = 255;
+        }
+    }
 }
 
-image3f read_png(const string& filename, bool flipY) {
-    vector<unsigned char> pixels;
-    unsigned width, height;
+// decode a PNG file to packed 8-bit rgba pixels
+static const vector<unsigned char>& _decode_png(const string& filename, unsigned& width, unsigned& height) {
+    // the decoding buffer is kept to be reused by the next read on this thread
+    static thread_local vector<unsigned char> pixels;
     
+    pixels.clear();
     unsigned error = lodepng::decode(pixels, width, height, filename);
     error_if_not(not error,"cannot read png image: %s", filename.c_str());
     
     error_if_not(pixels.size() == width*height*4, "bad reading");
+    return pixels;
+}
+
+image3f read_png(const string& filename, bool flipY, ImageTransfer transfer) {
+    unsigned width, height;
+    auto& pixels = _decode_png(filename, width, height);
     
     image3f img(width,height);
-    for(int i = 0; i < width*height; i ++) {
-        int x = i%width;
-        int y = i/width;
-        int ii = (flipY) ? x + (height-y-1)*width : x + y*width;
-        img.data()[ii].x = pixels[i*4+0] / 255.0f;
-        img.data()[ii].y = pixels[i*4+1] / 255.0f;
-        img.data()[ii].z = pixels[i*4+2] / 255.0f;
-    }
+    auto table = _transfer_tables().decode[transfer];
+    _parallel_rows(height, [&](int y) {
+        auto src = pixels.data() + y*width*4;
+        auto dst = &img.at(0, (flipY) ? height-y-1 : y);
+        for(auto x : range(width)) dst[x] = vec3f(table[src[x*4+0]], table[src[x*4+1]], table[src[x*4+2]]);
+    });
     
     return img;
 }
 
-void write_png(const string& filename, const image3f& img, bool flipY) {
-    vector<unsigned char> img_png(img.width()*img.height()*4);
-    for(int x = 0; x < img.width(); x++ ) {
-        for( int y = 0; y < img.height(); y++ ) {
-            int i_img = y * img.width() + x;
-            int i_png = ( ( flipY ? (img.height()-1-y) : y ) * img.width() + x ) * 4;
-            img_png[i_png+0] = (unsigned char)clamp(img.data()[i_img].x * 255, 0.0f, 255.0f);
-            img_png[i_png+1] = (unsigned char)clamp(img.data()[i_img].y * 255, 0.0f, 255.0f);
-            img_png[i_png+2] = (unsigned char)clamp(img.data()[i_img].z * 255, 0.0f, 255.0f);
-            img_png[i_png+3] = 255;
+image3ub read_png_rgb8(const string& filename, bool flipY) {
+    unsigned width, height;
+    auto& pixels = _decode_png(filename, width, height);
+    
+    image3ub img(width,height);
+    _parallel_rows(height, [&](int y) {
+        auto src = pixels.data() + y*width*4;
+        auto dst = &img.at(0, (flipY) ? height-y-1 : y);
+        for(auto x : range(width)) { dst[x].x = src[x*4+0]; dst[x].y = src[x*4+1]; dst[x].z = src[x*4+2]; }
+    });
+    
+    return img;
+}
+
+// convert a floating point color image to packed 8-bit rgba pixels in buffer
+static void _to_rgba(const image3f& img, bool flipY, ImageTransfer transfer, vector<unsigned char>& buffer) {
+    buffer.resize(img.width()*img.height()*4);
+    _parallel_rows(img.height(), [&](int y) {
+        auto dst = buffer.data() + ( flipY ? (img.height()-1-y) : y ) * img.width() * 4;
+        _encode_row(&img.at(0,y), dst, img.width(), transfer);
+    });
+}
+
+PngOptions png_options;
+
+// bit reader of a deflate stream, least significant bit first
+struct _BitReader {
+    const unsigned char*    data = nullptr; // stream
+    size_t                  size = 0;       // stream size in bytes
+    size_t                  pos = 0;        // position in bits
+    
+    // read n bits
+    unsigned bits(int n) {
+        error_if_not(pos + n <= size*8, "truncated deflate stream");
+        auto v = 0u;
+        for(auto i : range(n)) { v |= ((data[pos >> 3] >> (pos & 7)) & 1u) << i; pos ++; }
+        return v;
+    }
+};
+
+// canonical huffman code, as counts of codes per length and symbols sorted by code
+struct _Huffman {
+    short   count[16];      // number of codes of each length
+    short   symbol[320];    // symbols ordered by code
+    
+    // build the code from the code length of each symbol
+    _Huffman(const unsigned char* lengths, int n) {
+        short offset[16];
+        for(auto& c : count) c = 0;
+        for(auto i : range(n)) count[lengths[i]] ++;
+        offset[1] = 0;
+        for(auto l : range(1,15)) offset[l+1] = offset[l] + count[l];
+        for(auto i : range(n)) if(lengths[i]) symbol[offset[lengths[i]]++] = i;
+    }
+    
+    // decode a symbol
+    int decode(_BitReader& in) const {
+        auto code = 0, first = 0, index = 0;
+        for(auto l : range(1,16)) {
+            code |= in.bits(1);
+            if(code - count[l] < first) return symbol[index + code - first];
+            index += count[l]; first = (first + count[l]) << 1; code <<= 1;
+        }
+        error("bad deflate huffman code");
+        return -1;
+    }
+};
+
+// walk the blocks of a deflate stream without inflating it, returning its length in bits
+// and setting final_bit to the position of the BFINAL bit of its last block
+static size_t _deflate_bits(const unsigned char* data, size_t size, size_t& final_bit) {
+    static const unsigned char length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    static const unsigned char dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+    static const unsigned char order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+    auto in = _BitReader();
+    in.data = data; in.size = size;
+    auto last = 0u;
+    while(not last) {
+        final_bit = in.pos;
+        last = in.bits(1);
+        auto type = in.bits(2);
+        if(type == 0) {
+            // stored block: skip to the byte boundary and over the data
+            in.pos = (in.pos + 7) & ~size_t(7);
+            auto length = in.bits(16);
+            in.bits(16);
+            in.pos += length*8;
+            continue;
+        }
+        error_if_not(type == 1 or type == 2, "bad deflate block type");
+        unsigned char lengths[320];
+        auto nlen = 288, ndist = 30;
+        if(type == 1) {
+            for(auto i : range(288)) lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+            for(auto i : range(30)) lengths[288+i] = 5;
+        } else {
+            nlen = in.bits(5) + 257; ndist = in.bits(5) + 1;
+            auto ncode = in.bits(4) + 4;
+            for(auto& l : lengths) l = 0;
+            for(auto i : range(ncode)) lengths[order[i]] = in.bits(3);
+            auto lencode = _Huffman(lengths, 19);
+            auto index = 0;
+            while(index < nlen + ndist) {
+                auto symbol = lencode.decode(in);
+                if(symbol < 16) { lengths[index++] = symbol; continue; }
+                auto length = 0, repeat = 0;
+                if(symbol == 16) { length = lengths[index-1]; repeat = 3 + in.bits(2); }
+                else if(symbol == 17) repeat = 3 + in.bits(3);
+                else repeat = 11 + in.bits(7);
+                error_if_not(index + repeat <= nlen + ndist, "bad deflate code lengths");
+                while(repeat--) lengths[index++] = length;
+            }
+        }
+        auto litcode = _Huffman(lengths, nlen);
+        auto distcode = _Huffman(lengths + nlen, ndist);
+        while(true) {
+            auto symbol = litcode.decode(in);
+            if(symbol < 256) continue;
+            if(symbol == 256) break;
+            in.bits(length_extra[symbol-257]);
+            in.bits(dist_extra[distcode.decode(in)]);
         }
     }
-    unsigned error = lodepng::encode(filename, img_png, img.width(), img.height());
+    return in.pos;
+}
+
+// adler32 of the concatenation of two buffers from their adler32s and the second size (as zlib's adler32_combine)
+static unsigned _adler32_combine(unsigned a1, unsigned a2, size_t len2) {
+    const unsigned base = 65521;
+    auto rem = unsigned(len2 % base);
+    auto sum1 = a1 & 0xffff;
+    auto sum2 = (rem * sum1) % base;
+    sum1 += (a2 & 0xffff) + base - 1;
+    sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    if(sum1 >= base) sum1 -= base;
+    if(sum1 >= base) sum1 -= base;
+    if(sum2 >= (base << 1)) sum2 -= (base << 1);
+    if(sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+// adler32 of a buffer
+static unsigned _adler32(const unsigned char* data, size_t size) {
+    auto s1 = 1u, s2 = 0u;
+    while(size) {
+        // largest run that cannot overflow before the modulo
+        auto n = std::min(size, size_t(5550));
+        for(auto i : range(n)) { s1 += data[i]; s2 += s1; }
+        s1 %= 65521; s2 %= 65521;
+        data += n; size -= n;
+    }
+    return (s2 << 16) | s1;
+}
+
+// png filter byte for a row, picking the filter with the least sum of absolute values (as lodepng heuristic)
+// or none, writing the filter type and the filtered row to out
+static void _filter_row(const unsigned char* row, const unsigned char* prev, int size, int bpp,
+                        bool heuristic, unsigned char* out, vector<unsigned char>& scratch) {
+    if(not heuristic) { out[0] = 0; std::copy(row, row+size, out+1); return; }
+    auto paeth = [](int a, int b, int c) {
+        auto pa = abs(b-c), pb = abs(a-c), pc = abs(a+b-2*c);
+        return (pc < pa and pc < pb) ? c : (pb < pa) ? b : a;
+    };
+    scratch.resize(size);
+    auto best = size_t(-1);
+    for(auto type : range(5)) {
+        auto sum = size_t(0);
+        for(auto i : range(size)) {
+            int a = (i >= bpp) ? row[i-bpp] : 0, b = (prev) ? prev[i] : 0, c = (prev and i >= bpp) ? prev[i-bpp] : 0;
+            int p = (type == 0) ? 0 : (type == 1) ? a : (type == 2) ? b : (type == 3) ? (a+b)/2 : paeth(a,b,c);
+            auto v = (unsigned char)(row[i] - p);
+            scratch[i] = v;
+            sum += (type == 0) ? v : abs((signed char)v);
+        }
+        if(sum < best) { best = sum; out[0] = type; std::copy(scratch.begin(), scratch.end(), out+1); }
+    }
+}
+
+// append a png chunk
+static void _png_chunk(vector<unsigned char>& png, const char* type, const unsigned char* data, size_t size) {
+    auto put32 = [&png](unsigned v) { for(auto s : {24,16,8,0}) png.push_back((v >> s) & 0xff); };
+    put32(size);
+    auto start = png.size();
+    png.insert(png.end(), type, type+4);
+    png.insert(png.end(), data, data+size);
+    put32(lodepng_crc32(png.data()+start, png.size()-start));
+}
+
+// encode a png on parallel threads: rows are filtered and deflated in independent chunks,
+// whose streams are stitched bit by bit into a single zlib stream
+static void _encode_png_parallel(vector<unsigned char>& png, const unsigned char* rgba, int width, int height,
+                                 bool flipY, PngProfile profile) {
+    // drop alpha when opaque and color when grey, as lodepng does
+    auto opaque = true, grey = true;
+    for(auto i : range(width*height)) {
+        auto p = rgba + i*4;
+        opaque = opaque and p[3] == 255;
+        grey = grey and p[0] == p[1] and p[1] == p[2];
+        if(not opaque and not grey) break;
+    }
+    auto colortype = (grey) ? ((opaque) ? LCT_GREY : LCT_GREY_ALPHA) : ((opaque) ? LCT_RGB : LCT_RGBA);
+    auto bpp = ((grey) ? 1 : 3) + ((opaque) ? 0 : 1);
+    auto stride = width*bpp;
+    
+    auto settings = LodePNGCompressSettings();
+    lodepng_compress_settings_init(&settings);
+    settings.windowsize = (profile == png_fast) ? 512 : (profile == png_max) ? 32768 : 2048;
+    auto heuristic = profile != png_fast;
+    
+    // chunk of rows compressed independently
+    struct Chunk {
+        vector<unsigned char>   deflated;       // deflate stream
+        size_t                  bits = 0;       // stream length in bits
+        size_t                  final_bit = 0;  // position of the BFINAL bit of the last block
+        size_t                  size = 0;       // filtered size
+        unsigned                adler = 1;      // adler32 of the filtered data
+    };
+    auto rows = std::max(1, (1 << 18) / (stride+1));
+    auto chunks = vector<Chunk>((height+rows-1)/rows);
+    parallel_for(chunks.size(), [&](int c) {
+        auto raw = [&](int y, unsigned char* out) {
+            auto src = rgba + ((flipY) ? height-1-y : y)*width*4;
+            if(bpp == 4) std::copy(src, src+width*4, out);
+            else if(bpp == 3) for(auto x : range(width)) { out[x*3+0] = src[x*4+0]; out[x*3+1] = src[x*4+1]; out[x*3+2] = src[x*4+2]; }
+            else if(bpp == 2) for(auto x : range(width)) { out[x*2+0] = src[x*4+0]; out[x*2+1] = src[x*4+3]; }
+            else for(auto x : range(width)) out[x] = src[x*4+0];
+        };
+        auto y0 = c*rows, y1 = std::min(height, (c+1)*rows);
+        auto filtered = vector<unsigned char>((y1-y0)*(stride+1));
+        auto row = vector<unsigned char>(stride), prev = vector<unsigned char>(stride), scratch = vector<unsigned char>();
+        if(y0 > 0) raw(y0-1, prev.data());
+        for(auto y : range(y0,y1)) {
+            raw(y, row.data());
+            _filter_row(row.data(), (y > 0) ? prev.data() : nullptr, stride, bpp, heuristic,
+                        filtered.data() + (y-y0)*(stride+1), scratch);
+            std::swap(row, prev);
+        }
+        auto& chunk = chunks[c];
+        unsigned char* out = nullptr;
+        size_t outsize = 0;
+        auto error = lodepng_deflate(&out, &outsize, filtered.data(), filtered.size(), &settings);
+        error_if_not(not error, "cannot deflate png data");
+        chunk.deflated.assign(out, out+outsize);
+        free(out);
+        chunk.bits = _deflate_bits(chunk.deflated.data(), chunk.deflated.size(), chunk.final_bit);
+        chunk.size = filtered.size();
+        chunk.adler = _adler32(filtered.data(), filtered.size());
+    });
+    
+    // zlib stream: header, chunk streams with all but the last BFINAL cleared, adler32
+    auto zlib = vector<unsigned char>{ 0x78, 0x01 };
+    auto bitpos = size_t(16);
+    auto adler = 1u;
+    for(auto c : range(chunks.size())) {
+        auto& chunk = chunks[c];
+        if(c+1 < (int)chunks.size()) chunk.deflated[chunk.final_bit >> 3] &= ~(1 << (chunk.final_bit & 7));
+        auto shift = bitpos & 7;
+        auto nbytes = (chunk.bits + 7) / 8;
+        if(not shift) zlib.insert(zlib.end(), chunk.deflated.begin(), chunk.deflated.begin()+nbytes);
+        else {
+            // bits past the end of a stream are zero, so they can be or-ed in
+            for(auto i : range(nbytes)) {
+                zlib.back() |= chunk.deflated[i] << shift;
+                zlib.push_back(chunk.deflated[i] >> (8-shift));
+            }
+        }
+        bitpos += chunk.bits;
+        zlib.resize((bitpos + 7) / 8);
+        adler = _adler32_combine(adler, chunk.adler, chunk.size);
+    }
+    for(auto s : {24,16,8,0}) zlib.push_back((adler >> s) & 0xff);
+    
+    // png file
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                                 (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                                 8, (unsigned char)colortype, 0, 0, 0 };
+    png.assign(signature, signature+8);
+    _png_chunk(png, "IHDR", header, 13);
+    _png_chunk(png, "IDAT", zlib.data(), zlib.size());
+    _png_chunk(png, "IEND", nullptr, 0);
+}
+
+// encode packed rgba pixels with the png_options profile and write them to a file
+static void _encode_png(const string& filename, const unsigned char* rgba, int width, int height, bool flipY) {
+    // the encoding buffers are kept to be reused by the next write on this thread
+    static thread_local vector<unsigned char> png, flipped;
+    auto error = 0u;
+    if(png_options.parallel) _encode_png_parallel(png, rgba, width, height, flipY, png_options.profile);
+    else {
+        if(flipY) {
+            flipped.resize(width*height*4);
+            for(int y = 0; y < height; y++) {
+                std::copy(rgba + y*width*4, rgba + (y+1)*width*4, flipped.begin() + (height-1-y)*width*4);
+            }
+            rgba = flipped.data();
+        }
+        auto state = lodepng::State();
+        if(png_options.profile == png_fast) {
+            state.encoder.filter_strategy = LFS_ZERO;
+            state.encoder.zlibsettings.windowsize = 512;
+        }
+        if(png_options.profile == png_max) {
+            state.encoder.filter_strategy = LFS_BRUTE_FORCE;
+            state.encoder.zlibsettings.windowsize = 32768;
+        }
+        png.clear();
+        error = lodepng::encode(png, rgba, width, height, state);
+    }
+    if(not error) lodepng::save_file(png, filename);
     error_if_not(not error, "cannot write png image: %s", filename.c_str());
 }
+
+void write_png(const string& filename, const image3f& img, bool flipY, ImageTransfer transfer) {
+    // the conversion buffer is kept to be reused by the next write on this thread
+    static thread_local vector<unsigned char> img_png;
+    _to_rgba(img, flipY, transfer, img_png);
+    _encode_png(filename, img_png.data(), img.width(), img.height(), false);
+}
+
+void write_png(const string& filename, const vector<unsigned char>& rgba, int width, int height, bool flipY) {
+    error_if_not(rgba.size() == size_t(width)*height*4, "bad pixel size");
+    _encode_png(filename, rgba.data(), width, height, flipY);
+}
+
+// background png writer: a queue of pending files consumed by a worker thread,
+// which drains the queue and exits when the program ends
+struct _PngWriter {
+    // pending png file
+    struct Job {
+        string                  filename;   // image filename
+        vector<unsigned char>   rgba;       // packed rgba pixels
+        int                     width;      // image width
+        int                     height;     // image height
+        bool                    flipY;      // whether to flip the image rows
+    };
+    
+    std::mutex                  mutex;          // guards the fields below
+    std::condition_variable     changed;        // signals queue or busy changes
+    std::deque<Job>             jobs;           // pending files
+    int                         busy = 0;       // files being written
+    bool                        stop = false;   // whether the program is ending
+    std::thread                 thread;         // worker thread (started on first use)
+    
+    ~_PngWriter() {
+        { std::lock_guard<std::mutex> lock(mutex); stop = true; }
+        changed.notify_all();
+        if(thread.joinable()) thread.join();
+    }
+};
+
+static _PngWriter _png_writer;
+static const int _png_writer_max_pending = 8;   // bounds the memory held by pending files
+
+static void _png_writer_loop() {
+    auto& writer = _png_writer;
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    while(true) {
+        writer.changed.wait(lock, [&writer]{ return writer.stop or not writer.jobs.empty(); });
+        if(writer.jobs.empty()) return;
+        auto job = std::move(writer.jobs.front());
+        writer.jobs.pop_front();
+        writer.busy ++;
+        lock.unlock();
+        writer.changed.notify_all();
+        write_png(job.filename, job.rgba, job.width, job.height, job.flipY);
+        lock.lock();
+        writer.busy --;
+        writer.changed.notify_all();
+    }
+}
+
+void write_png_async(const string& filename, vector<unsigned char>&& rgba, int width, int height, bool flipY) {
+    auto& writer = _png_writer;
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    if(not writer.thread.joinable()) writer.thread = std::thread(_png_writer_loop);
+    writer.changed.wait(lock, [&writer]{ return writer.jobs.size() < _png_writer_max_pending; });
+    writer.jobs.push_back({filename, std::move(rgba), width, height, flipY});
+    lock.unlock();
+    writer.changed.notify_all();
+}
+
+void write_png_async(const string& filename, const image3f& img, bool flipY, ImageTransfer transfer) {
+    auto rgba = vector<unsigned char>();
+    _to_rgba(img, flipY, transfer, rgba);
+    write_png_async(filename, std::move(rgba), img.width(), img.height(), false);
+}
+
+void write_png_async_wait() {
+    auto& writer = _png_writer;
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.changed.wait(lock, [&writer]{ return writer.jobs.empty() and not writer.busy; });
+}
@@ -4,78 +4,260 @@
 #include "common.h"
 #include "vmath.h"
 
-// A generic image
-struct image3f {
+// Half precision floating point number (IEEE 754 binary16), used to store pixels compactly
+struct half {
+    unsigned short bits = 0;    // sign, 5 exponent and 10 mantissa bits
+    
+    // Default Constructor (zero)
+    half() { }
+    // Conversion from float, rounding to nearest
+    half(float f) : bits(from_float(f)) { }
+    // Conversion to float (exact)
+    operator float() const { return to_float(bits); }
+    
+    // float to half bits
+    static unsigned short from_float(float f) {
+        unsigned int x; memcpy(&x, &f, sizeof(x));
+        unsigned short sign = (x >> 16) & 0x8000;
+        int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+        unsigned int mant = x & 0x7fffff;
+        if(((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | ((mant) ? 0x200 : 0);
+        if(exp >= 31) return sign | 0x7c00;
+        if(exp <= 0) {
+            if(exp < -10) return sign;
+            mant |= 0x800000;
+            auto shift = 14 - exp;
+            return sign | ((mant >> shift) + ((mant >> (shift-1)) & 1));
+        }
+        // a carry out of the mantissa correctly rounds up into the exponent
+        return sign | (((exp << 10) | (mant >> 13)) + ((mant >> 12) & 1));
+    }
+    // half bits to float
+    static float to_float(unsigned short h) {
+        unsigned int sign = (h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, x = 0;
+        if(exp == 31) x = sign | 0x7f800000 | (mant << 13);
+        else if(exp) x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        else if(mant) {
+            exp = 127 - 15 + 1;
+            while(not (mant & 0x400)) { mant <<= 1; exp--; }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        } else x = sign;
+        float f; memcpy(&f, &x, sizeof(f)); return f;
+    }
+};
+
+// 8-bit rgb pixel
+struct vec3ub {
+    unsigned char x = 0, y = 0, z = 0;      // components
+};
+// 8-bit rgba pixel
+struct vec4ub {
+    unsigned char x = 0, y = 0, z = 0, w = 255; // components
+};
+// half precision rgb pixel
+struct vec3h {
+    half x, y, z;                           // components
+};
+
+// pixel conversion to floating point colors (8-bit values map [0,255] to [0,1], alpha is dropped)
+inline vec3f to_vec3f(const vec3f& p) { return p; }
+inline vec3f to_vec3f(const vec3ub& p) { return vec3f(p.x,p.y,p.z) / 255.0f; }
+inline vec3f to_vec3f(const vec4ub& p) { return vec3f(p.x,p.y,p.z) / 255.0f; }
+inline vec3f to_vec3f(const vec3h& p) { return vec3f(p.x,p.y,p.z); }
+
+// pixel conversion from floating point colors (8-bit values are clamped and rounded)
+template<typename T> inline T from_vec3f(const vec3f& c);
+template<> inline vec3f from_vec3f<vec3f>(const vec3f& c) { return c; }
+template<> inline vec3ub from_vec3f<vec3ub>(const vec3f& c) {
+    auto q = [](float v) { return (unsigned char)(std::min(1.0f,std::max(0.0f,v))*255+0.5f); };
+    auto p = vec3ub(); p.x = q(c.x); p.y = q(c.y); p.z = q(c.z); return p;
+}
+template<> inline vec4ub from_vec3f<vec4ub>(const vec3f& c) {
+    auto rgb = from_vec3f<vec3ub>(c);
+    auto p = vec4ub(); p.x = rgb.x; p.y = rgb.y; p.z = rgb.z; return p;
+}
+template<> inline vec3h from_vec3f<vec3h>(const vec3f& c) {
+    auto p = vec3h(); p.x = c.x; p.y = c.y; p.z = c.z; return p;
+}
+
+// A non-owning view of image pixels, with rows stride pixels apart
+// (a negative stride walks the rows backwards, viewing the image flipped along y)
+template<typename T>
+struct image_view {
+    T*      data = nullptr;     // first pixel of row 0
+    int     width = 0;          // view width
+    int     height = 0;         // view height
+    int     stride = 0;         // pixels from the start of a row to the start of the next
+    
+    // element access
+    T& at(int i, int j) const { return data[(ptrdiff_t)j*stride+i]; }
+    // row access
+    T* row(int j) const { return data + (ptrdiff_t)j*stride; }
+};
+typedef image_view<vec3f> image3f_view;
+
+// flips the rows of a view in place
+template<typename T>
+inline void flipy_inplace(const image_view<T>& img) {
+    parallel_for(img.height/2, [&](int j) {
+        std::swap_ranges(img.row(j), img.row(j)+img.width, img.row(img.height-1-j));
+    });
+}
+// applies gamma correction to a view in place
+void gamma_inplace(const image3f_view& img, float gamma);
+// scales the pixels of a view in place
+void scale_inplace(const image3f_view& img, float s);
+
+// A generic image, storing pixels of type T
+template<typename T>
+struct image {
     // Default Constructor (empty image)
-    image3f() : _w(0), _h(0) { }
+    image() : _w(0), _h(0) { }
     // Size Constructor (sets width and height)
-    image3f(int w, int h) : _w(w), _h(h), _d(_w*_h,vec3f()) { }
+    image(int w, int h) : _w(w), _h(h), _d(_w*_h,T()) { }
     // Size Constructor with initialization (sets width and height and initialize pixels)
-    image3f(int w, int h, const vec3f& v) : _w(w), _h(h), _d(_w*_h,vec3f()) {
-        for(auto &p : _d) p = v;
-    }
+    image(int w, int h, const T& v) : _w(w), _h(h), _d(_w*_h,v) { }
     
     // image width
     int width() const { return _w; }
     // image height
     int height() const { return _h; }
+    // whether the image has no pixels
+    bool empty() const { return _d.empty(); }
     
     // element access
-    vec3f& at(int i, int j) { return _d[j*_w+i]; }
+    T& at(int i, int j) { return _d[j*_w+i]; }
     // element access
-    const vec3f& at(int i, int j) const { return _d[j*_w+i]; }
+    const T& at(int i, int j) const { return _d[j*_w+i]; }
     
     // data access
-    vec3f* data() { return _d.data(); }
+    T* data() { return _d.data(); }
     // data access
-    const vec3f* data() const { return _d.data(); }
+    const T* data() const { return _d.data(); }
     
-    // flips this image along the y axis returning a new image
-    image3f flipy() const {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,height()-1-j) = at(i,j);
-            }
-        }
-        return ret;
+    // view of the pixels, flipped along the y axis if flipY
+    image_view<T> view(bool flipY = false) {
+        auto v = image_view<T>();
+        v.data = (flipY and _h) ? &at(0,_h-1) : data();
+        v.width = _w; v.height = _h; v.stride = (flipY) ? -_w : _w;
+        return v;
     }
     
-    // apply gamma correction
-    image3f gamma(float gamma) const {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,j) = pow(at(i,j),gamma);
-            }
-        }
-        return ret;
-    }
+    // flips this image along the y axis returning a new image
+    image flipy() const { auto ret = *this; flipy_inplace(ret.view()); return ret; }
     
-    // apply a scale to the image
-    image3f scale(float s) {
-        image3f ret(width(),height());
-        for(int j = 0; j < height(); j ++) {
-            for(int i = 0; i < width(); i ++) {
-                ret.at(i,j) = at(i,j)*s;
-            }
-        }
-        return ret;
-    }
+    // apply gamma correction (floating point images only)
+    image gamma(float gamma) const { auto ret = *this; gamma_inplace(ret.view(), gamma); return ret; }
+    
+    // apply a scale to the image (floating point images only)
+    image scale(float s) const { auto ret = *this; scale_inplace(ret.view(), s); return ret; }
     
 private:
     int _w, _h;
-    vector<vec3f> _d;
+    vector<T> _d;
+};
+typedef image<vec3f> image3f;   // floating point color image (12 bytes per pixel)
+typedef image<vec3h> image3h;   // half precision color image (6 bytes per pixel)
+typedef image<vec3ub> image3ub; // 8-bit color image (3 bytes per pixel)
+typedef image<vec4ub> image4ub; // 8-bit color and alpha image (4 bytes per pixel)
+
+// converts the pixels of an image to another pixel type
+template<typename R, typename T>
+inline image<R> convert_image(const image<T>& img) {
+    auto ret = image<R>(img.width(), img.height());
+    parallel_for(img.height(), [&](int j) {
+        for(auto i : range(img.width())) ret.at(i,j) = from_vec3f<R>(to_vec3f(img.at(i,j)));
+    });
+    return ret;
+}
+
+// Storage format of a texture
+enum ImageFormat { rgb8_format, rgb16f_format, rgb32f_format };
+
+// A texture image held in the pixel format it was sourced in (8-bit for PNG, half floats for PFM),
+// with floating point colors converted on demand; only the mip levels of its format are filled
+struct texture {
+    ImageFormat         format = rgb32f_format; // storage format
+    vector<image3ub>    rgb8;                   // 8-bit mip levels (level 0 is the full image)
+    vector<image3h>     rgb16f;                 // half precision mip levels
+    vector<image3f>     rgb32f;                 // floating point mip levels
+    
+    // Constructor of an empty texture, to fill once its image is read
+    texture() { }
+    // Constructors from each storage (a single level, see make_texture_mipmaps)
+    texture(image3ub&& img) : format(rgb8_format) { rgb8.push_back(std::move(img)); }
+    texture(image3h&& img) : format(rgb16f_format) { rgb16f.push_back(std::move(img)); }
+    texture(image3f&& img) : format(rgb32f_format) { rgb32f.push_back(std::move(img)); }
+    
+    // number of mip levels
+    int levels() const { return (format == rgb8_format) ? rgb8.size() : (format == rgb16f_format) ? rgb16f.size() : rgb32f.size(); }
+    // level width
+    int width(int l = 0) const { return (format == rgb8_format) ? rgb8[l].width() : (format == rgb16f_format) ? rgb16f[l].width() : rgb32f[l].width(); }
+    // level height
+    int height(int l = 0) const { return (format == rgb8_format) ? rgb8[l].height() : (format == rgb16f_format) ? rgb16f[l].height() : rgb32f[l].height(); }
+    // raw pixel data of a level, in the storage format
+    const void* data(int l = 0) const { return (format == rgb8_format) ? (const void*)rgb8[l].data() : (format == rgb16f_format) ? (const void*)rgb16f[l].data() : (const void*)rgb32f[l].data(); }
+    
+    // element access, converted to a floating point color
+    vec3f at(int i, int j, int l = 0) const {
+        switch(format) {
+            case rgb8_format: return to_vec3f(rgb8[l].at(i,j));
+            case rgb16f_format: return to_vec3f(rgb16f[l].at(i,j));
+            default: return rgb32f[l].at(i,j);
+        }
+    }
+    // conversion of a whole level to floating point colors
+    image3f to_image3f(int l = 0) const {
+        switch(format) {
+            case rgb8_format: return convert_image<vec3f>(rgb8[l]);
+            case rgb16f_format: return convert_image<vec3f>(rgb16f[l]);
+            default: return rgb32f[l];
+        }
+    }
+};
+
+// Build the mip levels below an image, each the 2x2 box filtered half of the previous one down to 1x1
+// (sizes round down as in OpenGL, so odd sizes drop their last row or column)
+vector<image3f> make_mipmaps(const image3f& img);
+// Build the mip levels of a texture in its storage format; if cache_filename is not empty, levels are
+// read from it when it is newer than source_filename and written to it otherwise
+void make_texture_mipmaps(texture* txt, const string& cache_filename = "", const string& source_filename = "");
+// Trilinear lookup at uv, blending bilinear lookups of the two mip levels around lod (the log2 of the
+// footprint in texels of the full image); coordinates repeat if repeat and are clamped to the edges otherwise
+vec3f lookup_texture(const texture* txt, const vec2f& uv, float lod = 0, bool repeat = true);
+
+// Transfer curve between linear floating point colors and 8-bit pixels
+enum ImageTransfer { linear_transfer, srgb_transfer, gamma_transfer /* gamma 2.2 */ };
+
+// PNG encoding profile, trading compression for speed
+enum PngProfile { png_fast /* no filters, small window */, png_default /* lodepng defaults */, png_max /* brute force filters, full window */ };
+
+// PNG encoding options used by all PNG writers
+struct PngOptions {
+    PngProfile  profile = png_default;  // encoding profile
+    bool        parallel = false;       // deflate independent chunks of rows on parallel threads
 };
+extern PngOptions png_options;
 
 // Write an floating point color PFM image file
 void write_pfm(const string& filename, const image3f& img, bool flipY = false);
-// Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere)
-void write_png(const string& filename, const image3f& img, bool flipY = false);
+// Write an 8-bit color compressed PNG file (sets PNG alpha to 1 everywhere), encoding colors with transfer
+void write_png(const string& filename, const image3f& img, bool flipY = false, ImageTransfer transfer = linear_transfer);
+// Write an 8-bit compressed PNG file from packed rgba pixels
+void write_png(const string& filename, const vector<unsigned char>& rgba, int width, int height, bool flipY = false);
+// Queue packed rgba pixels to be compressed and written as PNG on a background thread
+// (blocks while too many files are pending)
+void write_png_async(const string& filename, vector<unsigned char>&& rgba, int width, int height, bool flipY = false);
+// Convert a floating point color image to 8-bit and queue it to be written as PNG on a background thread
+void write_png_async(const string& filename, const image3f& img, bool flipY = false, ImageTransfer transfer = linear_transfer);
+// Wait until all queued PNG files are written
+void write_png_async_wait();
 
 // Load a PFM or PPM color image and return it as a floating point color image
 image3f read_pnm(const string& filename, bool flipY);
-// Load a compressed PNG color image and return it as a floating point color image
-image3f read_png(const string& filename, bool flipY);
+// Load a compressed PNG color image and return it as a floating point color image, decoding colors with transfer
+image3f read_png(const string& filename, bool flipY, ImageTransfer transfer = linear_transfer);
+// Load a compressed PNG color image keeping its 8-bit pixels (alpha is dropped)
+image3ub read_png_rgb8(const string& filename, bool flipY);
 
 #endif
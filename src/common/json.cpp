@@ -1,52 +1,372 @@
 #include "json.h"
-#include "picojson.h"
-
-// json value conversion from parser
-static jsonvalue _to_jsonvalue(const picojson::value& pjson) {
-    if(pjson.is<picojson::null>()) return jsonvalue();
-    else if(pjson.is<bool>()) return jsonvalue( pjson.get<bool>() );
-    else if(pjson.is<double>()) return jsonvalue( pjson.get<double>() );
-    else if(pjson.is<string>()) return jsonvalue( pjson.get<string>() );
-    else if(pjson.is<picojson::array>()) {
-        auto json = jsonvalue::array();
-        for(auto& j : pjson.get<picojson::array>()) json.push_back(_to_jsonvalue(j));
-        return jsonvalue(json);
-    }
-    else if(pjson.is<picojson::object>()) {
-        auto json = jsonvalue::object();
-        for(auto& nj : pjson.get<picojson::object>()) json[nj.first] = _to_jsonvalue(nj.second);
-        return jsonvalue(json);
-    } else { error("unknown type"); return jsonvalue(); }
+
+// json parser state, reading either a buffer holding the whole text or a file streamed in chunks
+// (tokens are only read after fill makes them available, so that they never straddle chunks)
+struct _JsonParser {
+    const char*     cur = nullptr;      // next character to read
+    const char*     begin = nullptr;    // text start (chunk start if streamed)
+    const char*     end = nullptr;      // text end (the buffer is null terminated)
+    string          filename;           // filename for error messages
+    vector<double>  numbers;            // numbers of the array being parsed, while it holds only numbers
+    FILE*           file = nullptr;     // file streamed in chunks, if any
+    vector<char>    chunk;              // chunk of the streamed file, null terminated
+    int             line = 1;           // line of begin
+    bool            failed = false;     // whether an error was reported
+    
+    static const int chunk_size = 1 << 20;  // bytes read from a streamed file at once
+    static const int max_token = 512;       // longest number or literal in a streamed file
+    
+    // makes n characters available from cur if the text has them, reading more of a streamed
+    // file if needed; returns whether they are available
+    bool fill(int n) {
+        if(end-cur >= n) return true;
+        if(not file or feof(file) or failed) return false;
+        line += std::count(begin, cur, '\n');
+        // the unread characters move to the start of the chunk, which may be still allocated
+        auto rest = end-cur;
+        if(chunk.size() < (size_t)(rest+chunk_size+1)) {
+            auto grown = vector<char>(rest+chunk_size+1);
+            if(rest) memcpy(grown.data(), cur, rest);
+            chunk.swap(grown);
+        } else memmove(chunk.data(), cur, rest);
+        auto read = fread(chunk.data()+rest, 1, chunk_size, file);
+        chunk[rest+read] = 0;
+        begin = cur = chunk.data();
+        end = begin + rest + read;
+        return end-cur >= n;
+    }
+    // reports an error at the current line, returning false to unwind the parse
+    bool fail(const char* msg) {
+        if(failed) return false;
+        auto at = line + std::count(begin, cur, '\n');
+        error("json reading error: %s at line %d of %s\n", msg, (int)at, filename.c_str());
+        cur = end;
+        failed = true;
+        return false;
+    }
+    // skips whitespace
+    void skip() { do { while(cur < end and (*cur == ' ' or *cur == '\n' or *cur == '\r' or *cur == '\t')) cur++; } while(cur == end and fill(1)); }
+    // consumes c after whitespace if it is next
+    bool next(char c) { skip(); if(cur < end and *cur == c) { cur++; return true; } return false; }
+    // consumes a literal word if it is next
+    bool word(const char* w) { auto n = strlen(w); if(fill(n) and strncmp(cur, w, n) == 0) { cur += n; return true; } return false; }
+};
+
+static bool _json_parse_value(_JsonParser& p, jsonvalue& value);
+
+// checks for a decimal digit, regardless of locale
+static bool _json_isdigit(char c) { return c >= '0' and c <= '9'; }
+
+// appends the utf-8 encoding of a code point
+static void _json_append_utf8(string& s, unsigned c) {
+    if(c < 0x80) s += (char)c;
+    else if(c < 0x800) { s += (char)(0xc0 | (c >> 6)); s += (char)(0x80 | (c & 0x3f)); }
+    else if(c < 0x10000) { s += (char)(0xe0 | (c >> 12)); s += (char)(0x80 | ((c >> 6) & 0x3f)); s += (char)(0x80 | (c & 0x3f)); }
+    else { s += (char)(0xf0 | (c >> 18)); s += (char)(0x80 | ((c >> 12) & 0x3f)); s += (char)(0x80 | ((c >> 6) & 0x3f)); s += (char)(0x80 | (c & 0x3f)); }
+}
+
+// parses the four hex digits of a \u escape
+static bool _json_parse_hex4(_JsonParser& p, unsigned& c) {
+    if(not p.fill(4)) return p.fail("bad unicode escape");
+    c = 0;
+    for(auto i : range(4)) {
+        auto h = p.cur[i];
+        c <<= 4;
+        if(h >= '0' and h <= '9') c |= h-'0';
+        else if(h >= 'a' and h <= 'f') c |= h-'a'+10;
+        else if(h >= 'A' and h <= 'F') c |= h-'A'+10;
+        else return p.fail("bad unicode escape");
+    }
+    p.cur += 4;
+    return true;
+}
+
+// parses a string after its opening quote, copying runs without escapes at once
+static bool _json_parse_string(_JsonParser& p, string& s) {
+    while(true) {
+        auto run = p.cur;
+        while(p.cur < p.end and *p.cur != '"' and *p.cur != '\\') p.cur++;
+        s.append(run, p.cur);
+        if(p.cur >= p.end) { if(p.fill(1)) continue; return p.fail("unterminated string"); }
+        if(*p.cur++ == '"') return true;
+        if(not p.fill(1)) return p.fail("unterminated string");
+        switch(*p.cur++) {
+            case '"': s += '"'; break;
+            case '\\': s += '\\'; break;
+            case '/': s += '/'; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u': {
+                unsigned c;
+                if(not _json_parse_hex4(p, c)) return false;
+                // surrogate pairs combine into one code point
+                if(c >= 0xd800 and c < 0xdc00) {
+                    unsigned c2;
+                    if(not (p.word("\\u") and _json_parse_hex4(p, c2) and c2 >= 0xdc00 and c2 < 0xe000)) return p.fail("bad surrogate pair");
+                    c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                }
+                _json_append_utf8(s, c);
+            } break;
+            default: return p.fail("bad escape");
+        }
+    }
+}
+
+// parses a number; up to 19 significant digits with a power of ten in [-22,22] are converted
+// exactly with one multiplication or division, other numbers are left to strtod
+static bool _json_parse_number(_JsonParser& p, double& d) {
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    // the number ends at the null terminator if fewer characters are left
+    p.fill(_JsonParser::max_token);
+    auto start = p.cur;
+    auto s = p.cur;
+    auto negative = (*s == '-');
+    if(negative) s++;
+    if(not _json_isdigit(*s)) return p.fail("bad number");
+    auto mantissa = (unsigned long long)0;
+    auto digits = 0, exponent = 0;
+    auto add_digit = [&](char c) { if(mantissa or c != '0') digits++; if(digits <= 19) mantissa = mantissa*10 + (c-'0'); };
+    if(*s == '0') s++;
+    else while(_json_isdigit(*s)) add_digit(*s++);
+    if(*s == '.') {
+        s++;
+        if(not _json_isdigit(*s)) return p.fail("bad number");
+        while(_json_isdigit(*s)) { add_digit(*s++); exponent--; }
+    }
+    if(*s == 'e' or *s == 'E') {
+        s++;
+        auto exponent_negative = (*s == '-');
+        if(*s == '-' or *s == '+') s++;
+        if(not _json_isdigit(*s)) return p.fail("bad number");
+        auto e = 0;
+        while(_json_isdigit(*s)) { if(e < 100000) e = e*10 + (*s-'0'); s++; }
+        exponent += (exponent_negative) ? -e : e;
+    }
+    p.cur = s;
+    if(digits <= 19 and mantissa <= (1ull << 53) and exponent >= -22 and exponent <= 22) {
+        d = (exponent < 0) ? mantissa / pow10[-exponent] : mantissa * pow10[exponent];
+        if(negative) d = -d;
+    } else d = strtod(start, nullptr);
+    return true;
+}
+
+static bool _json_parse_value(_JsonParser& p, jsonvalue& value) {
+    // the value may already be set, by a repeated object key, and is replaced
+    value._clear();
+    p.skip();
+    if(p.cur >= p.end) return p.fail("unexpected end");
+    switch(*p.cur) {
+        case '{': {
+            p.cur++;
+            value._type = jsonvalue::objectt;
+            value._o = new jsonvalue::object();
+            if(p.next('}')) return true;
+            // members are parsed in place in their map nodes
+            auto key = string();
+            do {
+                if(not p.next('"')) return p.fail("expected string key");
+                key.clear();
+                if(not _json_parse_string(p, key)) return false;
+                if(not p.next(':')) return p.fail("expected ':'");
+                if(not _json_parse_value(p, (*value._o)[key])) return false;
+            } while(p.next(','));
+            if(not p.next('}')) return p.fail("expected ',' or '}'");
+            return true;
+        }
+        case '[': {
+            p.cur++;
+            value._type = jsonvalue::arrayt;
+            value._a = new jsonvalue::array();
+            if(p.next(']')) return true;
+            // numbers are collected while the array holds only numbers, so that they are packed
+            // without making values; other elements are parsed in place at the end of the array
+            // (a nested array is only met after the numbers are flushed, so they are never shared)
+            auto& elements = *value._a;
+            auto numeric = true;
+            p.numbers.clear();
+            do {
+                p.skip();
+                if(numeric and p.cur < p.end and (*p.cur == '-' or _json_isdigit(*p.cur))) {
+                    auto d = 0.0;
+                    if(not _json_parse_number(p, d)) return false;
+                    p.numbers.push_back(d);
+                    continue;
+                }
+                if(numeric) {
+                    numeric = false;
+                    elements.reserve(p.numbers.size()+1);
+                    for(auto d : p.numbers) elements.emplace_back(d);
+                    p.numbers.clear();
+                }
+                elements.emplace_back();
+                if(not _json_parse_value(p, elements.back())) return false;
+            } while(p.next(','));
+            if(not p.next(']')) return p.fail("expected ',' or ']'");
+            if(numeric) {
+                delete value._a;
+                auto ints = std::all_of(p.numbers.begin(), p.numbers.end(),
+                                        [](double d) { return d >= INT_MIN and d <= INT_MAX and d == (int)d and not (d == 0 and std::signbit(d)); });
+                if(ints) { value._type = jsonvalue::intarrayt; value._ia = new vector<int>(p.numbers.begin(), p.numbers.end()); }
+                else { value._type = jsonvalue::floatarrayt; value._fa = new vector<float>(p.numbers.begin(), p.numbers.end()); }
+                p.numbers.clear();
+            } else elements.shrink_to_fit();
+            return true;
+        }
+        case '"': {
+            p.cur++;
+            value._type = jsonvalue::stringt;
+            value._s = new string();
+            return _json_parse_string(p, *value._s);
+        }
+        case 't': if(not p.word("true")) return p.fail("bad literal"); value = jsonvalue(true); return true;
+        case 'f': if(not p.word("false")) return p.fail("bad literal"); value = jsonvalue(false); return true;
+        case 'n': if(not p.word("null")) return p.fail("bad literal"); return true;
+        default: {
+            auto d = 0.0;
+            if(not _json_parse_number(p, d)) return false;
+            value = jsonvalue(d);
+            return true;
+        }
+    }
+}
+
+jsonvalue parse_json(const string& text, const string& filename) {
+    auto p = _JsonParser();
+    p.begin = p.cur = text.c_str();
+    p.end = p.begin + text.size();
+    p.filename = filename;
+    auto json = jsonvalue();
+    if(_json_parse_value(p, json)) {
+        p.skip();
+        if(p.cur < p.end) p.fail("unexpected text after value");
+    }
+    return json;
+}
+
+// skips a value, reading only one string at a time
+static bool _json_skip_value(_JsonParser& p) {
+    p.skip();
+    if(p.cur >= p.end or (*p.cur != '{' and *p.cur != '[')) {
+        auto value = jsonvalue();
+        return _json_parse_value(p, value);
+    }
+    auto object = (*p.cur++ == '{');
+    auto close = (object) ? '}' : ']';
+    if(p.next(close)) return true;
+    auto key = string();
+    do {
+        if(object) {
+            if(not p.next('"')) return p.fail("expected string key");
+            if(not _json_parse_string(p, key)) return false;
+            key.clear();
+            if(not p.next(':')) return p.fail("expected ':'");
+        }
+        if(not _json_skip_value(p)) return false;
+    } while(p.next(','));
+    if(not p.next(close)) return p.fail((object) ? "expected ',' or '}'" : "expected ',' or ']'");
+    return true;
 }
 
 // json handling
 jsonvalue load_json(const string& filename) {
-    // open file
-    std::ifstream stream(filename.c_str(), std::ifstream::in);
-    error_if_not(stream.good(), "cannot open file: %s\n", filename.c_str());
-    // read json
-    picojson::value pjson;
-    stream >> pjson;
-    auto err = picojson::get_last_error();
-    error_if_not(err.empty(), "json reading error: %s\n", err.c_str());
-    stream.close();
-    // conversion
-    auto json = _to_jsonvalue(pjson);
-    // done
+    JsonReader reader(filename);
+    auto json = reader.read_value();
+    reader.end();
+    return json;
+}
+
+JsonReader::JsonReader(const string& filename) : _parser(new _JsonParser()) {
+    _parser->filename = filename;
+    _parser->file = fopen(filename.c_str(), "rb");
+    error_if_not(_parser->file, "cannot open file: %s\n", filename.c_str());
+    if(not _parser->file) _parser->failed = true;
+}
+
+JsonReader::~JsonReader() {
+    if(_parser->file) fclose(_parser->file);
+    delete _parser;
+}
+
+void JsonReader::begin_object() {
+    if(_parser->next('{')) _first.push_back(true);
+    else _parser->fail("expected object");
+}
+
+bool JsonReader::next_member(string& name) {
+    auto& p = *_parser;
+    if(p.failed or _first.empty()) return false;
+    if(_first.back()) {
+        _first.back() = false;
+        if(p.next('}')) { _first.pop_back(); return false; }
+    } else if(not p.next(',')) {
+        if(not p.next('}')) return p.fail("expected ',' or '}'");
+        _first.pop_back();
+        return false;
+    }
+    if(not p.next('"')) return p.fail("expected string key");
+    name.clear();
+    if(not _json_parse_string(p, name)) return false;
+    if(not p.next(':')) return p.fail("expected ':'");
+    return true;
+}
+
+void JsonReader::begin_array() {
+    if(_parser->next('[')) _first.push_back(true);
+    else _parser->fail("expected array");
+}
+
+bool JsonReader::next_element() {
+    auto& p = *_parser;
+    if(p.failed or _first.empty()) return false;
+    if(_first.back()) {
+        _first.back() = false;
+        if(p.next(']')) { _first.pop_back(); return false; }
+    } else if(not p.next(',')) {
+        if(not p.next(']')) return p.fail("expected ',' or ']'");
+        _first.pop_back();
+        return false;
+    }
+    return true;
+}
+
+double JsonReader::read_number() {
+    auto& p = *_parser;
+    auto d = 0.0;
+    p.skip();
+    if(p.cur < p.end and (*p.cur == '-' or _json_isdigit(*p.cur))) _json_parse_number(p, d);
+    else p.fail("expected number");
+    return d;
+}
+
+jsonvalue JsonReader::read_value() {
+    auto json = jsonvalue();
+    _json_parse_value(*_parser, json);
     return json;
 }
 
+void JsonReader::skip_value() { _json_skip_value(*_parser); }
+
+void JsonReader::end() {
+    _parser->skip();
+    if(_parser->cur < _parser->end) _parser->fail("unexpected text after value");
+}
+
 // print usage information
 static void _cmdline_print_usage(const CommandLine& cmd) {
     auto usage = "usage: " + cmd.progname;
-    for(auto opt : cmd.options) {
+    for(auto& opt : cmd.options) {
         usage += " ";
         auto optname = (opt.flag == "") ? "--"+opt.name : "-"+opt.flag;
         auto optval = (opt.type != typeid(bool)) ? " <"+opt.name+">" : "";
         if(opt.opt) usage += "[" + optname + optval + "]";
         else usage += optname + optval;
+        if(opt.type == typeid(vector<string>)) usage += "...";
     }
-    for(auto arg : cmd.arguments) {
+    for(auto& arg : cmd.arguments) {
         usage += " ";
         if(arg.opt) usage += "[" + arg.name + "]";
         else usage += arg.name;
@@ -54,12 +374,12 @@ static void _cmdline_print_usage(const CommandLine& cmd) {
     usage += "\n\n";
     if(not cmd.options.empty() or not cmd.arguments.empty()) {
         usage += "options:\n";
-        for(auto opt : cmd.options) {
+        for(auto& opt : cmd.options) {
             usage += "    " + ( (opt.flag == "")?"":"-"+opt.flag+"/" ) +
                      "--" + opt.name + ( (opt.type==typeid(bool))?"":" "+opt.name) + "\n";
             usage += "        " + opt.desc + "\n";
         }
-        for(auto arg : cmd.arguments) {
+        for(auto& arg : cmd.arguments) {
             usage += "    " + arg.name + ( (arg.type==typeid(bool))?"":" "+arg.name) + "\n";
             usage += "        " + arg.desc + "\n";
         }
@@ -98,7 +418,19 @@ jsonvalue parse_cmdline(const vector<string>& args, const CommandLine& cmd) {
     auto parsed = jsonvalue::object();
     auto largs = args; // make a copy to change
     set<string> visited;
-    for(auto opt : cmd.options) {
+    for(auto& opt : cmd.options) {
+        // repeated options collect their values, in order, into an array
+        if(typeid(vector<string>) == opt.type) {
+            auto values = jsonvalue::array();
+            for(auto i = 0; i < (int)largs.size(); ) {
+                if(largs[i] != "--"+opt.name and (opt.flag == "" or largs[i] != "-"+opt.flag)) { i++; continue; }
+                if(i == (int)largs.size()-1) _cmdline_parse_error(tostring("no value for argument %s",opt.name.c_str()), cmd);
+                values.emplace_back(largs[i+1]);
+                largs.erase(largs.begin()+i,largs.begin()+i+2);
+            }
+            parsed[opt.name] = jsonvalue(std::move(values));
+            continue;
+        }
         auto pos = -1;
         for(auto i : range(largs.size())) {
             if (largs[i] == "--"+opt.name or largs[i] == "-"+opt.flag) { pos = i; break; }
@@ -108,7 +440,7 @@ jsonvalue parse_cmdline(const vector<string>& args, const CommandLine& cmd) {
             else _cmdline_parse_error(tostring("required option -%s",opt.flag.c_str()),cmd);
         } else {
             if(typeid(bool) != opt.type) {
-                if(pos == largs.size()-1) _cmdline_parse_error(tostring("no value for argument %s",opt.name.c_str()), cmd);
+                if(pos == (int)largs.size()-1) _cmdline_parse_error(tostring("no value for argument %s",opt.name.c_str()), cmd);
                 auto sval = largs[pos+1];
                 largs.erase(largs.begin()+pos,largs.begin()+pos+2);
                 parsed[opt.name] = _cmdline_parse_value(sval,opt,cmd);
@@ -118,10 +450,10 @@ jsonvalue parse_cmdline(const vector<string>& args, const CommandLine& cmd) {
             }
         }
     }
-    for(auto arg : largs) {
+    for(auto& arg : largs) {
         if(arg[0] == '-') _cmdline_parse_error(tostring("unknown option %s", arg.c_str()),cmd);
     }
-    for(auto arg : cmd.arguments) {
+    for(auto& arg : cmd.arguments) {
         if(largs.empty()) {
             if(arg.opt) parsed[arg.name] = arg.def;
             else _cmdline_parse_error(tostring("missing required argument %s",arg.name.c_str()),cmd);
@@ -131,7 +463,7 @@ jsonvalue parse_cmdline(const vector<string>& args, const CommandLine& cmd) {
         }
     }
     if(not largs.empty()) _cmdline_parse_error("too many arguments",cmd);
-    return jsonvalue(parsed);
+    return jsonvalue(std::move(parsed));
 }
 
 // parsing values
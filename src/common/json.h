@@ -11,15 +11,18 @@ struct jsonvalue {
     typedef vector<jsonvalue> array;
     typedef map<string,jsonvalue> object;
     
-    // possible types of jsonvalue
-    enum _Type { nullt, boolt, doublet, stringt, arrayt, objectt };
+    // possible types of jsonvalue (numeric arrays are packed as ints if all their numbers are
+    // ints, and as floats otherwise, so that their numbers keep float precision)
+    enum _Type { nullt, boolt, doublet, stringt, arrayt, objectt, intarrayt, floatarrayt };
     _Type _type = nullt;    // current type
     union {
-        bool    _b; // bool value
-        double  _d; // number value
-        string* _s; // string value
-        array*  _a; // generic array value
-        object* _o; // object type
+        bool            _b;  // bool value
+        double          _d;  // number value
+        string*         _s;  // string value
+        array*          _a;  // generic array value
+        object*         _o;  // object type
+        vector<int>*    _ia; // packed int array value
+        vector<float>*  _fa; // packed float array value
     };
     
     // constructor
@@ -33,21 +36,36 @@ struct jsonvalue {
     explicit jsonvalue(const char* s) : _type(stringt), _s(new string(s)) { }
     explicit jsonvalue(const array& a) : _type(arrayt), _a(new vector<jsonvalue>(a)) { }
     explicit jsonvalue(const object& o) : _type(objectt), _o(new map<string,jsonvalue>(o)) { }
+    explicit jsonvalue(const vector<int>& a) : _type(intarrayt), _ia(new vector<int>(a)) { }
+    explicit jsonvalue(const vector<float>& a) : _type(floatarrayt), _fa(new vector<float>(a)) { }
+    
+    // value constructors taking the contents of temporaries
+    explicit jsonvalue(string&& s) : _type(stringt), _s(new string(std::move(s))) { }
+    explicit jsonvalue(array&& a) : _type(arrayt), _a(new vector<jsonvalue>(std::move(a))) { }
+    explicit jsonvalue(object&& o) : _type(objectt), _o(new map<string,jsonvalue>(std::move(o))) { }
+    explicit jsonvalue(vector<int>&& a) : _type(intarrayt), _ia(new vector<int>(std::move(a))) { }
+    explicit jsonvalue(vector<float>&& a) : _type(floatarrayt), _fa(new vector<float>(std::move(a))) { }
     
     // copy constructor
     jsonvalue(const jsonvalue& j) : _type(nullt) { set(j); }
+    // move constructor (takes the value of j, leaving it null; containers of values move them as they grow)
+    jsonvalue(jsonvalue&& j) noexcept : _type(nullt) { take(j); }
     
     // destuctor
     ~jsonvalue() { _clear(); }
     
     // assignment
-    jsonvalue& operator=(const jsonvalue& j) { set(j); return *this; }
+    jsonvalue& operator=(const jsonvalue& j) { if(this != &j) set(j); return *this; }
+    // move assignment
+    jsonvalue& operator=(jsonvalue&& j) noexcept { take(j); return *this; }
     
     // clear
     void _clear() {
         if(_type==stringt) delete _s;
         if(_type==arrayt) delete _a;
         if(_type==objectt) delete _o;
+        if(_type==intarrayt) delete _ia;
+        if(_type==floatarrayt) delete _fa;
         _type = nullt;
     }
     // set
@@ -61,8 +79,29 @@ struct jsonvalue {
             case stringt: _s = new string(*j._s); break;
             case arrayt: _a = new vector<jsonvalue>(*j._a); break;
             case objectt: _o = new map<string,jsonvalue>(*j._o); break;
+            case intarrayt: _ia = new vector<int>(*j._ia); break;
+            case floatarrayt: _fa = new vector<float>(*j._fa); break;
+            default: error("wrong type");
+        }
+    }
+    
+    // take the value of j without copying strings, arrays or objects, leaving j null
+    void take(jsonvalue& j) {
+        if(this == &j) return;
+        if(_type != nullt) _clear();
+        _type = j._type;
+        switch(_type) {
+            case nullt: break;
+            case boolt: _b = j._b; break;
+            case doublet: _d = j._d; break;
+            case stringt: _s = j._s; break;
+            case arrayt: _a = j._a; break;
+            case objectt: _o = j._o; break;
+            case intarrayt: _ia = j._ia; break;
+            case floatarrayt: _fa = j._fa; break;
             default: error("wrong type");
         }
+        j._type = nullt;
     }
     
     // type checking
@@ -70,7 +109,8 @@ struct jsonvalue {
     bool is_bool() const { return _type == boolt; }
     bool is_number() const { return _type == doublet; }
     bool is_string() const { return _type == stringt; }
-    bool is_array() const { return _type == arrayt; }
+    bool is_array() const { return _type == arrayt or _type == intarrayt or _type == floatarrayt; }
+    bool is_packed_array() const { return _type == intarrayt or _type == floatarrayt; }
     bool is_object() const { return _type == objectt; }
     
     // getters for values
@@ -80,19 +120,89 @@ struct jsonvalue {
     double as_double() const { error_if_not(is_number(), "wrong type"); return _d; }
     string as_string() const { error_if_not(is_string(), "wrong type"); return *_s; }
     
-    // getters for arrays and objects
-    const vector<jsonvalue>& as_array_ref() const { error_if_not(is_array(), "wrong type"); return *_a; }
+    // getters for arrays and objects (packed arrays are read with array_number or as_numbers)
+    const vector<jsonvalue>& as_array_ref() const { error_if_not(_type == arrayt, "wrong type"); return *_a; }
     const map<string,jsonvalue>& as_object_ref() const { error_if_not(is_object(), "wrong type"); return *_o; }
 
     // proprties of arrays and objects
-    int array_size() const { return as_array_ref().size(); }
-    const jsonvalue& array_element(int idx) const { error_if_not(idx >= 0 and idx < array_size(), "wrong element index"); return as_array_ref().at(idx); }
+    // (packed arrays hold numbers, not values: array_size and array_number work for all arrays,
+    // while array_element is only for arrays of values and errors on packed ones)
+    int array_size() const {
+        if(_type == intarrayt) return _ia->size();
+        if(_type == floatarrayt) return _fa->size();
+        return as_array_ref().size();
+    }
+    const jsonvalue& array_element(int idx) const {
+        error_if_not(not is_packed_array(), "packed arrays have no element values, use array_number");
+        error_if_not(idx >= 0 and idx < array_size(), "wrong element index");
+        return as_array_ref()[idx];
+    }
+    double array_number(int idx) const {
+        error_if_not(idx >= 0 and idx < array_size(), "wrong element index");
+        if(_type == intarrayt) return (*_ia)[idx];
+        if(_type == floatarrayt) return (*_fa)[idx];
+        return as_array_ref()[idx].as_double();
+    }
+    
+    // copies the numbers of an array, converting them with one pass over packed arrays
+    template<typename T>
+    void as_numbers(T* values, int n) const {
+        error_if_not(n == array_size(), "incorrect array size");
+        if(_type == intarrayt) std::copy(_ia->begin(), _ia->end(), values);
+        else if(_type == floatarrayt) std::copy(_fa->begin(), _fa->end(), values);
+        else for(auto i : range(n)) values[i] = (T)(*_a)[i].as_double();
+    }
     bool object_contains(const string& name) const { return as_object_ref().find(name) != as_object_ref().end(); }
     const jsonvalue& object_element(const string& name) const { error_if_not(object_contains(name), "wrong element name"); return as_object_ref().find(name)->second; }
 };
 
-// json loading
+// json loading (the file is streamed in chunks and parsed straight into values)
 jsonvalue load_json(const string& filename);
+// json parsing of a text buffer (errors name the line, with filename for context)
+jsonvalue parse_json(const string& text, const string& filename = "");
+
+// json parser state
+struct _JsonParser;
+
+// Streaming json reader: the file is read in chunks of bounded size while the caller walks its
+// values in order, decoding the ones it wants straight into their destination and skipping the others
+// To use:
+//     reader.begin_object();
+//     while(reader.next_member(name)) {
+//         if(name == "pos") { reader.begin_array(); while(reader.next_element()) pos.push_back(reader.read_number()); }
+//         else if(name == "frame") set_frame(reader.read_value());
+//         else reader.skip_value();
+//     }
+struct JsonReader {
+    // opens a file
+    JsonReader(const string& filename);
+    // closes the file
+    ~JsonReader();
+    
+    // starts reading an object
+    void begin_object();
+    // reads the name of the next member of the current object, or returns false at its end
+    bool next_member(string& name);
+    // starts reading an array
+    void begin_array();
+    // whether the current array has another element, or false at its end
+    bool next_element();
+    // reads a number
+    double read_number();
+    // reads a whole value
+    jsonvalue read_value();
+    // skips a value without building it
+    void skip_value();
+    // checks that only whitespace is left
+    void end();
+    
+    _JsonParser*    _parser = nullptr;  // parser state
+    vector<bool>    _first;             // for each open object or array, whether none of its elements was read
+    
+private:
+    JsonReader(const JsonReader&);
+    JsonReader& operator=(const JsonReader&);
+};
 
 // command line specification
 struct CommandLine {
@@ -101,7 +211,7 @@ struct CommandLine {
         string                  name;   // complete name
         string                  flag;   // flag string name
         string                  desc;   // description
-        const std::type_info&   type;   // supported: int, double, bool (flag), string
+        const std::type_info&   type;   // supported: int, double, bool (flag), string, vector<string> (repeated option)
         bool                    opt;    // whether it is optional argument
         jsonvalue               def;    // default value
     };
@@ -0,0 +1,317 @@
+#include "raster.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const int raster_tile_size = 64;    // tile side in samples, each tile is rasterized by one thread at a time
+
+// vertex after vertex processing, as output by model_vertex.glsl
+struct RasterVertex {
+    vec4f       clip;           // clip space position
+    vec3f       pos;            // world space position
+    vec3f       norm;           // world space normal (need normalization)
+    vec2f       texcoord;       // texture coordinate
+};
+
+// triangle after clipping and setup, ready for binning
+struct RasterTriangle {
+    RasterVertex vert[3];       // vertices
+    vec3f       screen[3];      // vertex position in samples (x,y) and normalized device depth (z)
+    float       invw[3];        // inverse of the vertex clip w, for perspective correct interpolation
+    vec3f       edge[3];        // edge function coefficients (a,b,c) of the edge opposite each vertex
+    float       area_inv = 0;   // inverse of the edge functions at their opposite vertex
+    vec4i       bbox;           // sample bounds (xmin,ymin,xmax,ymax), inclusive
+    Material*   mat = nullptr;  // material
+};
+
+// interpolate two vertices
+static RasterVertex _lerp(const RasterVertex& a, const RasterVertex& b, float t) {
+    auto v = RasterVertex();
+    v.clip = a.clip*(1-t) + b.clip*t;
+    v.pos = a.pos*(1-t) + b.pos*t;
+    v.norm = a.norm*(1-t) + b.norm*t;
+    v.texcoord = a.texcoord*(1-t) + b.texcoord*t;
+    return v;
+}
+
+// distance of a clip space position from the near plane, positive inside
+static float _near_dist(const RasterVertex& v) { return v.clip.z + v.clip.w; }
+
+// whether a primitive is entirely outside one of the frustum side or far planes
+static bool _outside(const RasterVertex* verts, int n) {
+    auto outside = [&](float s, int c) {
+        for(auto i : range(n)) {
+            auto p = verts[i].clip;
+            auto x = (c == 0) ? p.x : (c == 1) ? p.y : p.z;
+            if(s*x <= p.w) return false;
+        }
+        return true;
+    };
+    return outside(1,0) or outside(-1,0) or outside(1,1) or outside(-1,1) or outside(1,2);
+}
+
+// project a clip space position to samples, keeping normalized device depth
+static vec3f _project(const vec4f& clip, int width, int height, float& invw) {
+    invw = 1 / clip.w;
+    return vec3f((clip.x*invw*0.5f+0.5f)*width, (clip.y*invw*0.5f+0.5f)*height, clip.z*invw);
+}
+
+// set up edge functions and sample bounds of a triangle from its screen positions,
+// accepting both windings; returns false if the triangle is degenerate or covers no sample
+static bool _setup_triangle(RasterTriangle& tri, int width, int height) {
+    for(auto i : range(3)) {
+        auto a = tri.screen[(i+1)%3], b = tri.screen[(i+2)%3];
+        auto ea = -(b.y-a.y), eb = b.x-a.x;
+        tri.edge[i] = vec3f(ea, eb, -(ea*a.x+eb*a.y));
+    }
+    auto area = dot(tri.edge[0], vec3f(tri.screen[0].x,tri.screen[0].y,1));
+    if(area == 0 or std::isnan(area)) return false;
+    if(area < 0) { for(auto& e : tri.edge) e = -e; area = -area; }
+    tri.area_inv = 1 / area;
+    auto xmin = min(tri.screen[0].x, min(tri.screen[1].x, tri.screen[2].x));
+    auto xmax = max(tri.screen[0].x, max(tri.screen[1].x, tri.screen[2].x));
+    auto ymin = min(tri.screen[0].y, min(tri.screen[1].y, tri.screen[2].y));
+    auto ymax = max(tri.screen[0].y, max(tri.screen[1].y, tri.screen[2].y));
+    // sample centers are at half integers
+    tri.bbox = vec4i(max(0,(int)ceil(xmin-0.5f)), max(0,(int)ceil(ymin-0.5f)),
+                     min(width-1,(int)floor(xmax-0.5f)), min(height-1,(int)floor(ymax-0.5f)));
+    return tri.bbox.x <= tri.bbox.z and tri.bbox.y <= tri.bbox.w;
+}
+
+// clip a triangle against the near plane and append the resulting triangles
+static void _add_triangle(vector<RasterTriangle>& triangles, const RasterVertex* verts,
+                          Material* mat, int width, int height) {
+    if(_outside(verts, 3)) return;
+    // clip the polygon edge by edge, yielding at most a quad
+    RasterVertex poly[4];
+    auto count = 0;
+    for(auto i : range(3)) {
+        auto& a = verts[i]; auto& b = verts[(i+1)%3];
+        auto da = _near_dist(a), db = _near_dist(b);
+        if(da >= 0) poly[count++] = a;
+        if((da >= 0) != (db >= 0)) poly[count++] = _lerp(a, b, da / (da-db));
+    }
+    // fan the clipped polygon into triangles
+    for(auto i : range(1,count-1)) {
+        auto tri = RasterTriangle();
+        tri.vert[0] = poly[0]; tri.vert[1] = poly[i]; tri.vert[2] = poly[i+1];
+        for(auto k : range(3)) tri.screen[k] = _project(tri.vert[k].clip, width, height, tri.invw[k]);
+        tri.mat = mat;
+        if(_setup_triangle(tri, width, height)) triangles.push_back(tri);
+    }
+}
+
+// clip a line against the near plane and append it as two triangles,
+// widened to one pixel (samples samples) across as for OpenGL lines
+static void _add_line(vector<RasterTriangle>& triangles, const RasterVertex* verts,
+                      Material* mat, int width, int height, int samples) {
+    if(_outside(verts, 2)) return;
+    RasterVertex a = verts[0], b = verts[1];
+    auto da = _near_dist(a), db = _near_dist(b);
+    if(da < 0 and db < 0) return;
+    if(da < 0) a = _lerp(a, b, da / (da-db));
+    if(db < 0) b = _lerp(a, b, da / (da-db));
+    float invw_a, invw_b;
+    auto sa = _project(a.clip, width, height, invw_a), sb = _project(b.clip, width, height, invw_b);
+    auto dir = vec2f(sb.x-sa.x, sb.y-sa.y);
+    if(lengthSqr(dir) == 0) return;
+    auto side = normalize(vec2f(-dir.y, dir.x)) * (samples * 0.5f);
+    auto offset = vec3f(side.x, side.y, 0);
+    // quad sa+offset, sa-offset, sb-offset, sb+offset
+    const RasterVertex* quad_verts[4] = { &a, &a, &b, &b };
+    vec3f quad_screen[4] = { sa+offset, sa-offset, sb-offset, sb+offset };
+    float quad_invw[4] = { invw_a, invw_a, invw_b, invw_b };
+    int fan[2][3] = { {0,1,2}, {0,2,3} };
+    for(auto& f : fan) {
+        auto tri = RasterTriangle();
+        for(auto k : range(3)) {
+            tri.vert[k] = *quad_verts[f[k]];
+            tri.screen[k] = quad_screen[f[k]];
+            tri.invw[k] = quad_invw[f[k]];
+        }
+        tri.mat = mat;
+        if(_setup_triangle(tri, width, height)) triangles.push_back(tri);
+    }
+}
+
+// transform the vertices of a mesh and append its faces and lines
+static void _add_mesh(vector<RasterTriangle>& triangles, Mesh* mesh, const mat4f& view_projection,
+                      int width, int height, int samples) {
+    // instances draw the geometry of their shape in their own frame
+    auto shape = mesh_shape(mesh);
+    auto verts = vector<RasterVertex>(shape->pos.size());
+    for(auto i : range(shape->pos.size())) {
+        auto& v = verts[i];
+        v.pos = transform_point(mesh->frame, shape->pos[i]);
+        if(not shape->norm.empty()) v.norm = transform_vector(mesh->frame, shape->norm[i]);
+        if(not shape->texcoord.empty()) v.texcoord = shape->texcoord[i];
+        v.clip = view_projection * vec4f(v.pos.x, v.pos.y, v.pos.z, 1);
+    }
+    for(auto f : shape->triangle) {
+        RasterVertex t[3] = { verts[f.x], verts[f.y], verts[f.z] };
+        _add_triangle(triangles, t, mesh->mat, width, height);
+    }
+    for(auto f : shape->quad) {
+        RasterVertex t0[3] = { verts[f.x], verts[f.y], verts[f.z] };
+        _add_triangle(triangles, t0, mesh->mat, width, height);
+        RasterVertex t1[3] = { verts[f.x], verts[f.z], verts[f.w] };
+        _add_triangle(triangles, t1, mesh->mat, width, height);
+    }
+    // splines not subdivided are drawn as their control polygons
+    auto lines = shape->line;
+    for(auto segment : shape->spline) {
+        lines.push_back({segment.x,segment.y});
+        lines.push_back({segment.y,segment.z});
+        lines.push_back({segment.z,segment.w});
+    }
+    for(auto l : lines) {
+        RasterVertex t[2] = { verts[l.x], verts[l.y] };
+        _add_line(triangles, t, mesh->mat, width, height, samples);
+    }
+}
+
+// evaluate the edge functions of a triangle at 4 consecutive samples starting at (x,y),
+// returning the coverage mask (bit k set if sample x+k is inside) and the edge values in e
+static int _coverage4(const RasterTriangle& tri, float x, float y, float e[3][4]) {
+#ifdef __SSE2__
+    auto xs = _mm_add_ps(_mm_set1_ps(x), _mm_set_ps(3,2,1,0));
+    auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for(auto i : range(3)) {
+        auto& edge = tri.edge[i];
+        auto v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edge.x), xs), _mm_set1_ps(edge.y*y+edge.z));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(v, _mm_setzero_ps()));
+        _mm_storeu_ps(e[i], v);
+    }
+    return _mm_movemask_ps(inside);
+#else
+    auto mask = 0;
+    for(auto k : range(4)) {
+        auto in = true;
+        for(auto i : range(3)) {
+            auto& edge = tri.edge[i];
+            e[i][k] = edge.x*(x+k) + (edge.y*y+edge.z);
+            in = in and e[i][k] >= 0;
+        }
+        if(in) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// blinn-phong shading of model_fragment.glsl, clamped as when stored in the framebuffer
+static vec3f _shade(Scene* scene, Material* mat, const vec3f& pos, const vec3f& norm, const vec2f& texcoord) {
+    auto n = normalize(norm);
+    if(mat->norm_txt) n = normalize(2*lookup_texture(mat->norm_txt,texcoord)-one3f);
+    auto kd = mat->kd * ((mat->kd_txt) ? lookup_texture(mat->kd_txt,texcoord) : one3f);
+    auto ks = mat->ks * ((mat->ks_txt) ? lookup_texture(mat->ks_txt,texcoord) : one3f);
+    auto c = scene->ambient * kd;
+    auto v = normalize(scene->camera->frame.o-pos);
+    for(auto light : scene->lights) {
+        auto cl = light->intensity / lengthSqr(light->frame.o-pos);
+        auto l = normalize(light->frame.o-pos);
+        auto h = normalize(v+l);
+        c += cl * max(0.0f,dot(l,n)) * (kd + ks * pow(max(0.0f,dot(h,n)),mat->n));
+    }
+    return clamp(c,0,1);
+}
+
+// rasterize the triangles binned to a tile, keeping the nearest triangle and its perspective
+// correct weights for each sample, then shade the visible samples once
+static void _raster_tile(Scene* scene, const vector<RasterTriangle>& triangles, const vector<int>& bin,
+                         vec4i tile, int width, vector<vec3f>& color) {
+    auto tw = tile.z-tile.x+1, th = tile.w-tile.y+1;
+    auto depth = vector<float>(tw*th, 1);
+    auto visible = vector<int>(tw*th, -1);
+    auto weights = vector<vec3f>(tw*th);
+    float e[3][4];
+    for(auto t : bin) {
+        auto& tri = triangles[t];
+        auto x0 = max(tri.bbox.x,tile.x), x1 = min(tri.bbox.z,tile.z);
+        auto y0 = max(tri.bbox.y,tile.y), y1 = min(tri.bbox.w,tile.w);
+        for(auto y : range(y0,y1+1)) {
+            for(auto x = x0; x <= x1; x += 4) {
+                auto mask = _coverage4(tri, x+0.5f, y+0.5f, e);
+                if(x1-x < 3) mask &= (1 << (x1-x+1)) - 1;
+                for(auto k = 0; mask; k ++, mask >>= 1) {
+                    if(not (mask & 1)) continue;
+                    auto b = vec3f(e[0][k], e[1][k], e[2][k]) * tri.area_inv;
+                    auto z = b.x*tri.screen[0].z + b.y*tri.screen[1].z + b.z*tri.screen[2].z;
+                    auto s = (y-tile.y)*tw + (x+k-tile.x);
+                    // depth test as GL_LEQUAL, discarding samples beyond the far plane
+                    if(z > depth[s] or z > 1) continue;
+                    depth[s] = z;
+                    visible[s] = t;
+                    auto w = vec3f(b.x*tri.invw[0], b.y*tri.invw[1], b.z*tri.invw[2]);
+                    weights[s] = w / (w.x+w.y+w.z);
+                }
+            }
+        }
+    }
+    for(auto j : range(th)) {
+        for(auto i : range(tw)) {
+            auto s = j*tw+i;
+            if(visible[s] < 0) continue;
+            auto& tri = triangles[visible[s]];
+            auto w = weights[s];
+            auto pos = tri.vert[0].pos*w.x + tri.vert[1].pos*w.y + tri.vert[2].pos*w.z;
+            auto norm = tri.vert[0].norm*w.x + tri.vert[1].norm*w.y + tri.vert[2].norm*w.z;
+            auto texcoord = tri.vert[0].texcoord*w.x + tri.vert[1].texcoord*w.y + tri.vert[2].texcoord*w.z;
+            color[(tile.y+j)*width + tile.x+i] = _shade(scene, tri.mat, pos, norm, texcoord);
+        }
+    }
+}
+
+// render the scene meshes and surface display meshes on the cpu
+image3f raster_scene(Scene* scene) {
+    auto samples = max(1,scene->image_samples);
+    auto width = scene->image_width*samples, height = scene->image_height*samples;
+
+    // same camera transform as shade()
+    auto camera = scene->camera;
+    auto view_projection = frustum_matrix(-camera->dist*camera->width/2, camera->dist*camera->width/2,
+                                          -camera->dist*camera->height/2, camera->dist*camera->height/2,
+                                          camera->dist,10000) * frame_to_matrix_inverse(camera->frame);
+
+    // process vertices and set up triangles in submission order
+    auto triangles = vector<RasterTriangle>();
+    for(auto mesh : scene->meshes) _add_mesh(triangles, mesh, view_projection, width, height, samples);
+    for(auto surface : scene->surfaces) {
+        if(surface->_display_mesh) _add_mesh(triangles, surface->_display_mesh, view_projection, width, height, samples);
+    }
+
+    // bin triangles to the tiles they overlap, keeping submission order within each bin
+    auto tiles_x = (width+raster_tile_size-1)/raster_tile_size;
+    auto tiles_y = (height+raster_tile_size-1)/raster_tile_size;
+    auto bins = vector<vector<int>>(tiles_x*tiles_y);
+    for(auto t : range(triangles.size())) {
+        auto& bbox = triangles[t].bbox;
+        for(auto ty : range(bbox.y/raster_tile_size, bbox.w/raster_tile_size+1)) {
+            for(auto tx : range(bbox.x/raster_tile_size, bbox.z/raster_tile_size+1)) {
+                bins[ty*tiles_x+tx].push_back(t);
+            }
+        }
+    }
+
+    // rasterize and shade tiles in parallel
+    auto color = vector<vec3f>(width*height, scene->background);
+    parallel_for(tiles_x*tiles_y, [&](int t) {
+        auto tx = t % tiles_x, ty = t / tiles_x;
+        auto tile = vec4i(tx*raster_tile_size, ty*raster_tile_size,
+                          min(width,(tx+1)*raster_tile_size)-1, min(height,(ty+1)*raster_tile_size)-1);
+        _raster_tile(scene, triangles, bins[t], tile, width, color);
+    });
+
+    // resolve samples with a box filter
+    auto image = image3f(scene->image_width, scene->image_height);
+    parallel_for(scene->image_height, [&](int j) {
+        for(auto i : range(scene->image_width)) {
+            auto c = zero3f;
+            for(auto sj : range(samples)) {
+                for(auto si : range(samples)) c += color[(j*samples+sj)*width + i*samples+si];
+            }
+            image.at(i,j) = c / (samples*samples);
+        }
+    });
+    return image;
+}
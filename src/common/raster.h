@@ -0,0 +1,14 @@
+#ifndef _RASTER_H_
+#define _RASTER_H_
+
+#include "common.h"
+#include "vmath.h"
+#include "image.h"
+#include "scene.h"
+
+// render the scene meshes and surface display meshes on the cpu, with the blinn-phong
+// shading of model_fragment.glsl; image_samples x image_samples samples are averaged
+// per pixel and, as with glReadPixels, row 0 is the bottom of the image
+image3f raster_scene(Scene* scene);
+
+#endif
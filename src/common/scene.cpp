@@ -1,7 +1,14 @@
 #include "scene.h"
 
-vector<image3f*> get_textures(Scene* scene) {
-    auto textures = set<image3f*>();
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+vector<texture*> get_textures(Scene* scene) {
+    auto textures = set<texture*>();
     for(auto mesh : scene->meshes) {
         if(mesh->mat->ke_txt) textures.insert(mesh->mat->ke_txt);
         if(mesh->mat->kd_txt) textures.insert(mesh->mat->kd_txt);
@@ -14,16 +21,60 @@ vector<image3f*> get_textures(Scene* scene) {
         if(surface->mat->ks_txt) textures.insert(surface->mat->ks_txt);
         if(surface->mat->norm_txt) textures.insert(surface->mat->norm_txt);
     }
-    return vector<image3f*>(textures.begin(),textures.end());
+    return vector<texture*>(textures.begin(),textures.end());
+}
+
+void invalidate_bounds(Mesh* mesh) {
+    mesh->_bbox_local_valid = false;
+}
+
+// set world space bounds from a bounding box in a local frame
+static void _set_world_bounds(const range3f& bbox_local, const frame3f& frame,
+                              range3f& bbox, vec3f& bsphere_center, float& bsphere_radius) {
+    bbox = range3f();
+    if(not isvalid(bbox_local)) { bsphere_center = frame.o; bsphere_radius = -1; return; }
+    for(auto c : corners(bbox_local)) bbox = runion(bbox, transform_point(frame, c));
+    // frames are orthonormal, so the local box sphere keeps its radius
+    bsphere_center = transform_point(frame, center(bbox_local));
+    bsphere_radius = length(size(bbox_local)) / 2;
 }
 
-Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
-    auto camera = new Camera();
-    camera->frame = lookat_frame(eye, center, up, true);
-    camera->width = width;
-    camera->height = height;
-    camera->dist = dist;
-    camera->focus = length(eye-center);
+void update_bounds(Mesh* mesh) {
+    // instances take the local bounds of their shape, which may change without them knowing
+    auto shape = mesh_shape(mesh);
+    if(shape == mesh and mesh->_bbox_local_valid and mesh->_bounds_frame == mesh->frame) return;
+    if(not shape->_bbox_local_valid) {
+        shape->_bbox_local = range3f();
+        for(auto& p : shape->pos) shape->_bbox_local = runion(shape->_bbox_local, p);
+        shape->_bbox_local_valid = true;
+    }
+    mesh->_bbox_local = shape->_bbox_local;
+    mesh->_bbox_local_valid = true;
+    mesh->_bounds_frame = mesh->frame;
+    _set_world_bounds(mesh->_bbox_local, mesh->frame, mesh->_bbox, mesh->_bsphere_center, mesh->_bsphere_radius);
+}
+
+void update_bounds(Surface* surface) {
+    if(surface->_bounds_radius == surface->radius and surface->_bounds_frame == surface->frame) return;
+    auto r = surface->radius;
+    // quads lie in the frame xy plane, displacement moves them up to one unit along z
+    auto bbox_local = (surface->isquad) ?
+        range3f(vec3f(-r,-r,0), vec3f(r,r,(surface->displacement_depth != 0) ? 1 : 0)) :
+        range3f(vec3f(-r,-r,-r), vec3f(r,r,r));
+    surface->_bounds_radius = surface->radius;
+    surface->_bounds_frame = surface->frame;
+    _set_world_bounds(bbox_local, surface->frame, surface->_bbox, surface->_bsphere_center, surface->_bsphere_radius);
+    // spheres are bounded tighter by themselves than by their box
+    if(not surface->isquad) surface->_bsphere_radius = r;
+}
+
+Camera lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist) {
+    auto camera = Camera();
+    camera.frame = lookat_frame(eye, center, up, true);
+    camera.width = width;
+    camera.height = height;
+    camera.dist = dist;
+    camera.focus = length(eye-center);
     return camera;
 }
 
@@ -51,14 +102,8 @@ void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, fl
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-void json_set_values(const jsonvalue& json, float* value, int n) {
-    error_if_not(n == json.array_size(), "incorrect array size");
-    for(auto i : range(n)) value[i] = json.array_element(i).as_float();
-}
-void json_set_values(const jsonvalue& json, int* value, int n) {
-    error_if_not(n == json.array_size(), "incorrect array size");
-    for(auto i : range(n)) value[i] = json.array_element(i).as_int();
-}
+void json_set_values(const jsonvalue& json, float* value, int n) { json.as_numbers(value, n); }
+void json_set_values(const jsonvalue& json, int* value, int n) { json.as_numbers(value, n); }
 
 void json_set_value(const jsonvalue& json, bool& value)  { value = json.as_bool(); }
 void json_set_value(const jsonvalue& json, int& value)   { value = json.as_int(); }
@@ -115,8 +160,16 @@ void json_set_optvalue(const jsonvalue& json, T& value, const string& name) {
 
 
 
+Arena*  json_scene_arena = nullptr;     // arena of the scene file being read, so that meshes from other files
+                                        // and references by name are resolved once it is read (nullptr otherwise)
+
+// allocates a scene object in the arena of the scene being read, or on the heap for meshes read
+// apart from scenes, such as the cached meshes of other files
+template<typename T>
+T* json_new(Arena* arena, const T& value = T()) { return (arena) ? arena->make<T>(value) : new T(value); }
+
 Camera* json_parse_camera(const jsonvalue& json) {
-    auto camera = new Camera();
+    auto camera = json_new<Camera>(json_scene_arena);
     json_set_optvalue(json, camera->frame, "frame");
     json_set_optvalue(json, camera->width, "width");
     json_set_optvalue(json, camera->height, "height");
@@ -134,11 +187,111 @@ Camera* json_parse_lookatcamera(const jsonvalue& json) {
     json_set_optvalue(json, width, "width");
     json_set_optvalue(json, height, "height");
     json_set_optvalue(json, dist, "dist");
-    return lookat_camera(from, to, up, width, height, dist);
+    return json_new(json_scene_arena, lookat_camera(from, to, up, width, height, dist));
 }
 
-vector<string>          json_texture_paths;
-map<string,image3f*>    json_texture_cache;
+// texture or mesh read from a file, kept in the asset cache
+struct _CachedAsset {
+    texture*            txt = nullptr;      // texture, for an image file
+    Mesh*               mesh = nullptr;     // mesh, for a mesh file
+    int                 refs = 0;           // references from loaded scenes and cached meshes
+    long long           last_used = 0;      // asset_cache_clock at the last use
+};
+
+map<string,_CachedAsset>        asset_cache;            // cached assets by canonical path and modification time
+map<texture*,string>            asset_cache_texture_keys; // key of each cached texture
+long long                       asset_cache_clock = 0;  // counts uses of cached assets, for least recently used eviction
+std::mutex                      asset_cache_mutex;      // guards the asset cache and pending textures while files load
+size_t                          asset_cache_budget = size_t(1) << 30;
+std::function<void(texture*)>   asset_cache_evicted;
+bool                            texture_mip_cache = false;
+
+thread_local vector<string>     json_texture_paths;     // directories of the files being read, per loading thread
+vector<pair<texture*,string>>   json_pending_textures;  // textures named so far, not decoded yet, with their image filename
+
+// cache key of a file, made of its canonical path and modification time, so that a file changed
+// since it was cached is read again (the filename as given if the file cannot be found)
+string asset_key(const string& filename) {
+    struct stat st;
+    if(stat(filename.c_str(), &st) != 0) return filename;
+#ifndef _WIN32
+    char path[PATH_MAX];
+    auto canonical = realpath(filename.c_str(), path);
+#else
+    char path[_MAX_PATH];
+    auto canonical = _fullpath(path, filename.c_str(), _MAX_PATH);
+#endif
+    return ((canonical) ? string(path) : filename) + "@" + std::to_string((long long)st.st_mtime);
+}
+
+// collects the textures of a material
+void _material_textures(Material* mat, set<texture*>& textures) {
+    for(auto txt : { mat->kd_txt, mat->ks_txt, mat->kr_txt, mat->norm_txt, mat->ke_txt }) if(txt) textures.insert(txt);
+}
+
+// adds d references to each cached texture in textures (asset_cache_mutex held)
+void _asset_cache_reference(const set<texture*>& textures, int d) {
+    for(auto txt : textures) {
+        auto key = asset_cache_texture_keys.find(txt);
+        if(key == asset_cache_texture_keys.end()) continue;
+        auto& asset = asset_cache[key->second];
+        asset.refs += d;
+        asset.last_used = ++asset_cache_clock;
+    }
+}
+
+size_t _asset_bytes(const _CachedAsset& asset) {
+    auto bytes = size_t(0);
+    if(asset.txt) for(auto l : range(asset.txt->levels())) {
+        auto pixel = (asset.txt->format == rgb8_format) ? sizeof(vec3ub) : (asset.txt->format == rgb16f_format) ? sizeof(vec3h) : sizeof(vec3f);
+        bytes += size_t(asset.txt->width(l)) * asset.txt->height(l) * pixel;
+    }
+    if(asset.mesh) {
+        auto mesh = asset.mesh;
+        bytes += mesh->pos.size()*sizeof(vec3f) + mesh->norm.size()*sizeof(vec3f) + mesh->texcoord.size()*sizeof(vec2f) +
+                 mesh->triangle.size()*sizeof(vec3i) + mesh->quad.size()*sizeof(vec4i) + mesh->point.size()*sizeof(int) +
+                 mesh->line.size()*sizeof(vec2i) + mesh->spline.size()*sizeof(vec4i);
+    }
+    return bytes;
+}
+
+// evicts unreferenced assets, least recently used first, until the cache fits its budget; evicting a mesh
+// releases its textures, which may then be evicted in turn
+void asset_cache_evict() {
+    std::lock_guard<std::mutex> lock(asset_cache_mutex);
+    auto bytes = size_t(0);
+    for(auto& asset : asset_cache) bytes += _asset_bytes(asset.second);
+    while(bytes > asset_cache_budget) {
+        auto lru = asset_cache.end();
+        for(auto it = asset_cache.begin(); it != asset_cache.end(); ++it) {
+            if(it->second.refs == 0 and (lru == asset_cache.end() or it->second.last_used < lru->second.last_used)) lru = it;
+        }
+        if(lru == asset_cache.end()) break;
+        bytes -= _asset_bytes(lru->second);
+        if(lru->second.mesh) {
+            auto textures = set<texture*>();
+            _material_textures(lru->second.mesh->mat, textures);
+            _asset_cache_reference(textures, -1);
+            delete lru->second.mesh->mat;
+            delete lru->second.mesh;
+        }
+        if(lru->second.txt) {
+            if(asset_cache_evicted) asset_cache_evicted(lru->second.txt);
+            asset_cache_texture_keys.erase(lru->second.txt);
+            delete lru->second.txt;
+        }
+        asset_cache.erase(lru);
+    }
+}
+
+void release_scene_assets(Scene* scene) {
+    {
+        std::lock_guard<std::mutex> lock(asset_cache_mutex);
+        _asset_cache_reference(set<texture*>(scene->_cached_textures.begin(), scene->_cached_textures.end()), -1);
+        scene->_cached_textures.clear();
+    }
+    asset_cache_evict();
+}
 
 void json_texture_path_push(string filename) {
     auto pos = filename.rfind("/");
@@ -147,43 +300,87 @@ void json_texture_path_push(string filename) {
 }
 void json_texture_path_pop() { json_texture_paths.pop_back(); }
 
-void json_parse_opttexture(jsonvalue json, image3f*& txt, string name) {
+void json_parse_opttexture(const jsonvalue& json, texture*& txt, const string& name) {
     if(not json.object_contains(name)) return;
     auto filename = json.object_element(name).as_string();
     if(filename.empty()) { txt = nullptr; return; }
     auto dirname = json_texture_paths.back();
     auto fullname = dirname + filename;
-    if (json_texture_cache.find(fullname) == json_texture_cache.end()) {
-        auto ext = fullname.substr(fullname.size()-3);
-        if(ext == "pfm") {
-            auto image = read_pnm("models/pisa_latlong.pfm", true);
-            image = image.gamma(1/2.2);
-            json_texture_cache[fullname] = new image3f(image);
-        } else if(ext == "png") {
-            auto image = read_png(fullname,true);
-            json_texture_cache[fullname] = new image3f(image);
-        } else error("unsupported image format %s\n", ext.c_str());
+    auto key = asset_key(fullname);
+    std::lock_guard<std::mutex> lock(asset_cache_mutex);
+    auto& asset = asset_cache[key];
+    if(not asset.txt) {
+        // the texture is decoded later, together with the other ones (see json_load_textures)
+        asset.txt = new texture();
+        asset_cache_texture_keys[asset.txt] = key;
+        json_pending_textures.push_back({asset.txt, fullname});
     }
-    txt = json_texture_cache[fullname];
+    asset.last_used = ++asset_cache_clock;
+    txt = asset.txt;
+}
+
+void json_load_texture(texture* txt, const string& filename) {
+    auto ext = filename.substr(filename.size()-3);
+    // images are kept in the pixel format of their source, halving floating point images
+    // and keeping 8-bit images as read, so that they are uploaded without conversions
+    if(ext == "pfm") {
+        auto img = read_pnm(filename, true);
+        gamma_inplace(img.view(), 1/2.2f);
+        *txt = texture(convert_image<vec3h>(img));
+    } else if(ext == "png") {
+        *txt = texture(read_png_rgb8(filename,true));
+    } else error("unsupported image format %s\n", ext.c_str());
+    // mip levels are built once at load, for filtered lookups and for upload
+    make_texture_mipmaps(txt, (texture_mip_cache) ? filename+".mips" : "", filename);
+}
+
+// decodes the pending textures, in parallel
+void json_load_textures() {
+    auto pending = vector<pair<texture*,string>>();
+    { std::lock_guard<std::mutex> lock(asset_cache_mutex); std::swap(pending, json_pending_textures); }
+    parallel_for(pending.size(), [&](int i) { json_load_texture(pending[i].first, pending[i].second); });
 }
 
 Material* json_parse_material(const jsonvalue& json) {
-    auto material = new Material();
+    auto material = json_new<Material>(json_scene_arena);
     json_set_optvalue(json, material->kd, "kd");
     json_set_optvalue(json, material->ks, "ks");
     json_set_optvalue(json, material->kr, "kr");
     json_set_optvalue(json, material->n, "n");
+    json_parse_opttexture(json, material->kd_txt, "kd_txt");
+    json_parse_opttexture(json, material->ks_txt, "ks_txt");
+    json_parse_opttexture(json, material->kr_txt, "kr_txt");
+    json_parse_opttexture(json, material->norm_txt, "norm_txt");
+    json_parse_opttexture(json, material->ke_txt, "ke_txt");
     return material;
 }
 
+vector<pair<Material**,string>> json_pending_materials;     // references to scene materials by name, resolved once the scene is read
+vector<pair<Mesh*,std::function<void(Mesh*)>>> json_pending_loaded; // meshes complete but for a material name, with their mesh_loaded
+
+// sets a material given inline or as the name of a scene material, shared by all that name it
+void json_set_material(const jsonvalue& json, Material*& material) {
+    if(not json.is_string()) { material = json_parse_material(json); return; }
+    error_if_not(json_scene_arena, "material %s named outside of a scene file\n", json.as_string().c_str());
+    json_pending_materials.push_back({&material, json.as_string()});
+}
+
+map<string,Material*> json_parse_materials(const jsonvalue& json) {
+    auto materials = map<string,Material*>();
+    for(auto& member : json.as_object_ref()) materials[member.first] = json_parse_material(member.second);
+    return materials;
+}
+
 
 Surface* json_parse_surface(const jsonvalue& json) {
-    auto surface = new Surface();
+    auto surface = json_new<Surface>(json_scene_arena);
     json_set_optvalue(json, surface->frame, "frame");
     json_set_optvalue(json, surface->radius,"radius");
     json_set_optvalue(json, surface->isquad,"isquad");
     json_set_optvalue(json, surface->displacement_depth,"displacement_depth");
-    if(json.object_contains("material")) surface->mat = json_parse_material(json.object_element("material"));
+    json_parse_opttexture(json, surface->displacement_txt, "displacement_txt");
+    if(json.object_contains("material")) json_set_material(json.object_element("material"), surface->mat);
+    else surface->mat = json_new<Material>(json_scene_arena);
     json_set_optvalue(json, surface->subdivision_level,"subdivision_level");
     json_set_optvalue(json, surface->subdivision_smooth,"subdivision_smooth");
     return surface;
@@ -191,45 +388,345 @@ Surface* json_parse_surface(const jsonvalue& json) {
 
 vector<Surface*> json_parse_surfaces(const jsonvalue& json) {
     vector<Surface*> surfaces;
-    for(auto value : json.as_array_ref()) surfaces.push_back( json_parse_surface(value) );
+    for(auto& value : json.as_array_ref()) surfaces.push_back( json_parse_surface(value) );
     return surfaces;
 }
 
 
 
-Mesh* json_parse_mesh(const jsonvalue& json) {
+// reads a numeric array straight into a vector of values made of S components, filling each value
+// as its numbers arrive (numbers left over after the last whole value are dropped)
+template<typename S, typename T>
+void json_read_values(JsonReader& reader, vector<T>& values) {
+    const auto n = (int)(sizeof(T)/sizeof(S));
+    auto value = T();
+    auto k = 0;
+    values.clear();
+    reader.begin_array();
+    while(reader.next_element()) {
+        ((S*)&value)[k++] = (S)reader.read_number();
+        if(k == n) { values.push_back(value); k = 0; }
+    }
+}
+
+// binary mesh files hold a header followed by the mesh arrays, each stored as is at a 16 byte aligned
+// offset, so that loading is a copy of mapped memory (values are in the byte order of the writer)
+struct _BinaryMeshHeader {
+    char        magic[4];               // "BMSH"
+    int         version;                // format version
+    frame3f     frame;                  // frame
+    vec3f       kd, ks, kr, ke;         // material coefficients
+    float       n;                      // material specular exponent
+    int         subdivision[4];         // catmullclark level and smooth, bezier level and uniform
+    int         reserved;               // zero, aligns the blocks to 8 bytes
+    long long   blocks[8][2];           // offset and count of pos, norm, texcoord, triangle, quad, point, line, spline
+};
+const int _binary_mesh_version = 1;
+
+// copies a block of count values at offset into values, checking it is within the size bytes of data
+template<typename T>
+static bool _read_binary_block(const char* data, size_t size, const long long* block, vector<T>& values) {
+    auto offset = block[0], count = block[1];
+    if(offset < 0 or count < 0 or (size_t)offset > size or (size_t)count > (size-offset)/sizeof(T)) return false;
+    values.resize(count);
+    if(count) std::memcpy(values.data(), data+offset, count*sizeof(T));
+    return true;
+}
+
+static Mesh* _read_binary_mesh(const char* data, size_t size, const string& filename) {
+    // files that cannot be read give an empty mesh
     auto mesh = new Mesh();
-    if(json.object_contains("json_mesh")) {
-        json_texture_path_push(json.object_element("json_mesh").as_string());
-        mesh = json_parse_mesh(load_json(json.object_element("json_mesh").as_string()));
-        json_texture_path_pop();
+    mesh->mat = new Material();
+    auto header = _BinaryMeshHeader();
+    error_if_not(size >= sizeof(header), "truncated binary mesh file %s\n", filename.c_str());
+    if(size < sizeof(header)) return mesh;
+    std::memcpy(&header, data, sizeof(header));
+    error_if_not(string(header.magic, 4) == "BMSH", "not a binary mesh file %s\n", filename.c_str());
+    error_if_not(header.version == _binary_mesh_version, "unsupported binary mesh version %d in %s\n", header.version, filename.c_str());
+    if(string(header.magic, 4) != "BMSH" or header.version != _binary_mesh_version) return mesh;
+    mesh->frame = header.frame;
+    mesh->mat->kd = header.kd;
+    mesh->mat->ks = header.ks;
+    mesh->mat->kr = header.kr;
+    mesh->mat->ke = header.ke;
+    mesh->mat->n = header.n;
+    mesh->subdivision_catmullclark_level = header.subdivision[0];
+    mesh->subdivision_catmullclark_smooth = header.subdivision[1];
+    mesh->subdivision_bezier_level = header.subdivision[2];
+    mesh->subdivision_bezier_uniform = header.subdivision[3];
+    auto ok = _read_binary_block(data, size, header.blocks[0], mesh->pos) and
+              _read_binary_block(data, size, header.blocks[1], mesh->norm) and
+              _read_binary_block(data, size, header.blocks[2], mesh->texcoord) and
+              _read_binary_block(data, size, header.blocks[3], mesh->triangle) and
+              _read_binary_block(data, size, header.blocks[4], mesh->quad) and
+              _read_binary_block(data, size, header.blocks[5], mesh->point) and
+              _read_binary_block(data, size, header.blocks[6], mesh->line) and
+              _read_binary_block(data, size, header.blocks[7], mesh->spline);
+    error_if_not(ok, "corrupted binary mesh file %s\n", filename.c_str());
+    return mesh;
+}
+
+Mesh* load_binary_mesh(const string& filename) {
+#ifndef _WIN32
+    auto fd = open(filename.c_str(), O_RDONLY);
+    error_if_not(fd >= 0, "cannot open binary mesh file %s\n", filename.c_str());
+    struct stat st;
+    auto ok = fstat(fd, &st) == 0 and st.st_size > 0;
+    auto size = (ok) ? (size_t)st.st_size : 0;
+    auto data = (ok) ? (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : (const char*)MAP_FAILED;
+    close(fd);
+    error_if_not(data != MAP_FAILED, "cannot map binary mesh file %s\n", filename.c_str());
+    if(data == MAP_FAILED) return _read_binary_mesh(nullptr, 0, filename);
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+    auto mesh = _read_binary_mesh(data, size, filename);
+    munmap((void*)data, size);
+    return mesh;
+#else
+    auto f = fopen(filename.c_str(), "rb");
+    error_if_not(f, "cannot open binary mesh file %s\n", filename.c_str());
+    if(not f) return _read_binary_mesh(nullptr, 0, filename);
+    auto buffer = vector<char>();
+    char chunk[1<<16];
+    for(auto n = fread(chunk, 1, sizeof(chunk), f); n > 0; n = fread(chunk, 1, sizeof(chunk), f)) buffer.insert(buffer.end(), chunk, chunk+n);
+    fclose(f);
+    return _read_binary_mesh(buffer.data(), buffer.size(), filename);
+#endif
+}
+
+// appends the bytes of values to data at a 16 byte aligned offset, recording offset and count in block
+template<typename T>
+static void _write_binary_block(vector<char>& data, long long* block, const vector<T>& values) {
+    data.resize((data.size()+15) & ~size_t(15), 0);
+    block[0] = data.size();
+    block[1] = values.size();
+    data.insert(data.end(), (const char*)values.data(), (const char*)(values.data()+values.size()));
+}
+
+void save_binary_mesh(const string& filename, Mesh* mesh) {
+    auto header = _BinaryMeshHeader();
+    std::memcpy(header.magic, "BMSH", 4);
+    header.version = _binary_mesh_version;
+    header.reserved = 0;
+    header.frame = mesh->frame;
+    header.kd = mesh->mat->kd;
+    header.ks = mesh->mat->ks;
+    header.kr = mesh->mat->kr;
+    header.ke = mesh->mat->ke;
+    header.n = mesh->mat->n;
+    header.subdivision[0] = mesh->subdivision_catmullclark_level;
+    header.subdivision[1] = mesh->subdivision_catmullclark_smooth;
+    header.subdivision[2] = mesh->subdivision_bezier_level;
+    header.subdivision[3] = mesh->subdivision_bezier_uniform;
+    auto data = vector<char>(sizeof(header), 0);
+    _write_binary_block(data, header.blocks[0], mesh->pos);
+    _write_binary_block(data, header.blocks[1], mesh->norm);
+    _write_binary_block(data, header.blocks[2], mesh->texcoord);
+    _write_binary_block(data, header.blocks[3], mesh->triangle);
+    _write_binary_block(data, header.blocks[4], mesh->quad);
+    _write_binary_block(data, header.blocks[5], mesh->point);
+    _write_binary_block(data, header.blocks[6], mesh->line);
+    _write_binary_block(data, header.blocks[7], mesh->spline);
+    std::memcpy(data.data(), &header, sizeof(header));
+    auto f = fopen(filename.c_str(), "wb");
+    error_if_not(f, "cannot create binary mesh file %s\n", filename.c_str());
+    if(not f) return;
+    error_if_not(fwrite(data.data(), 1, data.size(), f) == data.size(), "error writing file %s\n", filename.c_str());
+    fclose(f);
+}
+
+// mesh whose members given in a scene override those of a mesh read from another file or of a scene shape
+struct _JsonPendingMesh {
+    Mesh*                       mesh = nullptr;     // mesh with the members given in the scene
+    Arena*                      arena = nullptr;    // arena owning the mesh (nullptr if on the heap)
+    set<string>                 names;              // names of the members given in the scene
+    string                      filename;           // json or binary mesh filename
+    bool                        binary = false;     // whether filename is a binary mesh
+    string                      shape;              // name of the scene shape, instead of a file
+    std::function<void(Mesh*)>  mesh_loaded;        // called once the mesh is complete
+};
+
+vector<_JsonPendingMesh>    json_pending_meshes;        // meshes waiting for their file, while a scene is read
+vector<_JsonPendingMesh>    json_pending_instances;     // meshes waiting for their shape, while a scene is read
+
+Mesh* _json_load_mesh(const string& filename);
+
+// returns the mesh of a file from the asset cache, reading it if missing, with a reference that
+// the caller releases with _json_release_mesh, passing the cache key set here (the file may change
+// after it is read, so the key is not computed again)
+Mesh* _json_acquire_mesh(const string& filename, bool binary, string& key) {
+    key = asset_key(filename);
+    {
+        std::lock_guard<std::mutex> lock(asset_cache_mutex);
+        auto asset = asset_cache.find(key);
+        if(asset != asset_cache.end() and asset->second.mesh) {
+            asset->second.refs++;
+            asset->second.last_used = ++asset_cache_clock;
+            return asset->second.mesh;
+        }
+    }
+    auto mesh = (binary) ? load_binary_mesh(filename) : _json_load_mesh(filename);
+    std::lock_guard<std::mutex> lock(asset_cache_mutex);
+    auto& asset = asset_cache[key];
+    if(asset.mesh) { delete mesh->mat; delete mesh; }
+    else {
+        // the cached mesh keeps its textures cached too
+        asset.mesh = mesh;
+        auto textures = set<texture*>();
+        _material_textures(mesh->mat, textures);
+        _asset_cache_reference(textures, 1);
+    }
+    asset.refs++;
+    asset.last_used = ++asset_cache_clock;
+    return asset.mesh;
+}
+
+void _json_release_mesh(const string& key) {
+    std::lock_guard<std::mutex> lock(asset_cache_mutex);
+    auto asset = asset_cache.find(key);
+    if(asset != asset_cache.end()) asset->second.refs--;
+}
+
+// fills in the members of a pending mesh that the scene did not give, copied from base
+void _json_merge_mesh(_JsonPendingMesh& pending, Mesh* base) {
+    auto mesh = pending.mesh;
+    auto& names = pending.names;
+    if(not names.count("frame")) mesh->frame = base->frame;
+    if(not names.count("pos")) mesh->pos = base->pos;
+    if(not names.count("norm")) mesh->norm = base->norm;
+    if(not names.count("texcoord")) mesh->texcoord = base->texcoord;
+    if(not names.count("triangle")) mesh->triangle = base->triangle;
+    if(not names.count("quad")) mesh->quad = base->quad;
+    if(not names.count("point")) mesh->point = base->point;
+    if(not names.count("line")) mesh->line = base->line;
+    if(not names.count("spline")) mesh->spline = base->spline;
+    if(not names.count("material")) mesh->mat = json_new(pending.arena, *base->mat);
+    if(not names.count("subdivision_catmullclark_level")) mesh->subdivision_catmullclark_level = base->subdivision_catmullclark_level;
+    if(not names.count("subdivision_catmullclark_smooth")) mesh->subdivision_catmullclark_smooth = base->subdivision_catmullclark_smooth;
+    if(not names.count("subdivision_bezier_level")) mesh->subdivision_bezier_level = base->subdivision_bezier_level;
+    if(not names.count("subdivision_bezier_uniform")) mesh->subdivision_bezier_uniform = base->subdivision_bezier_uniform;
+}
+
+// completes a pending mesh from the cached mesh of its file
+void json_load_mesh(_JsonPendingMesh& pending) {
+    auto key = string();
+    _json_merge_mesh(pending, _json_acquire_mesh(pending.filename, pending.binary, key));
+    _json_release_mesh(key);
+    if(pending.mesh_loaded) pending.mesh_loaded(pending.mesh);
+}
+
+// completes a pending mesh from its scene shape: meshes that only give a frame or a material are
+// instances that draw the shape geometry, the others copy it and change it
+void json_instance_mesh(_JsonPendingMesh& pending, const map<string,Mesh*>& shapes) {
+    auto shape = shapes.find(pending.shape);
+    error_if_not(shape != shapes.end(), "unknown shape %s\n", pending.shape.c_str());
+    if(shape == shapes.end()) return;
+    auto mesh = pending.mesh;
+    auto& names = pending.names;
+    auto instance = true;
+    for(auto& name : names) if(name != "shape" and name != "frame" and name != "material") instance = false;
+    if(instance) {
+        mesh->shape = shape->second;
+        if(not names.count("frame")) mesh->frame = shape->second->frame;
+    } else _json_merge_mesh(pending, shape->second);
+    if(not names.count("material")) mesh->mat = shape->second->mat;
+    if(pending.mesh_loaded) pending.mesh_loaded(mesh);
+}
+
+Mesh* json_read_mesh(JsonReader& reader, const std::function<void(Mesh*)>& mesh_loaded = nullptr) {
+    auto mesh = json_new<Mesh>(json_scene_arena);
+    auto names = set<string>();
+    auto name = string();
+    auto json_mesh = string();
+    auto binary_mesh = string();
+    auto shape = string();
+    reader.begin_object();
+    while(reader.next_member(name)) {
+        if(name == "pos") json_read_values<float>(reader, mesh->pos);
+        else if(name == "norm") json_read_values<float>(reader, mesh->norm);
+        else if(name == "texcoord") json_read_values<float>(reader, mesh->texcoord);
+        else if(name == "triangle") json_read_values<int>(reader, mesh->triangle);
+        else if(name == "quad") json_read_values<int>(reader, mesh->quad);
+        else if(name == "point") json_read_values<int>(reader, mesh->point);
+        else if(name == "line") json_read_values<int>(reader, mesh->line);
+        else if(name == "spline") json_read_values<int>(reader, mesh->spline);
+        else if(name == "json_mesh") json_mesh = reader.read_value().as_string();
+        else if(name == "binary_mesh") binary_mesh = reader.read_value().as_string();
+        else if(name == "shape") shape = reader.read_value().as_string();
+        else if(name == "frame") json_set_value(reader.read_value(), mesh->frame);
+        else if(name == "material") json_set_material(reader.read_value(), mesh->mat);
+        else if(name == "subdivision_catmullclark_level") json_set_value(reader.read_value(), mesh->subdivision_catmullclark_level);
+        else if(name == "subdivision_catmullclark_smooth") json_set_value(reader.read_value(), mesh->subdivision_catmullclark_smooth);
+        else if(name == "subdivision_bezier_level") json_set_value(reader.read_value(), mesh->subdivision_bezier_level);
+        else if(name == "subdivision_bezier_uniform") json_set_value(reader.read_value(), mesh->subdivision_bezier_uniform);
+        else { reader.skip_value(); continue; }
+        // only the members read are recorded, so that other ones (e.g. names or comments) do not override the base mesh
+        names.insert(name);
+    }
+    if(json_mesh.empty() and binary_mesh.empty() and shape.empty()) {
+        if(not names.count("material")) mesh->mat = json_new<Material>(json_scene_arena);
+        // a mesh naming a scene material is complete once the material is resolved
+        if(mesh_loaded and not mesh->mat) json_pending_loaded.push_back({mesh, mesh_loaded});
+        else if(mesh_loaded) mesh_loaded(mesh);
+        return mesh;
     }
-    json_set_optvalue(json, mesh->frame, "frame");
-    json_set_optvalue(json, mesh->pos, "pos");
-    json_set_optvalue(json, mesh->norm, "norm");
-    json_set_optvalue(json, mesh->texcoord, "texcoord");
-    json_set_optvalue(json, mesh->triangle, "triangle");
-    json_set_optvalue(json, mesh->quad, "quad");
-    json_set_optvalue(json, mesh->point, "point");
-    json_set_optvalue(json, mesh->line, "line");
-    json_set_optvalue(json, mesh->spline, "spline");
-    if(json.object_contains("material")) mesh->mat = json_parse_material(json.object_element("material"));
-    json_set_optvalue(json, mesh->subdivision_catmullclark_level, "subdivision_catmullclark_level");
-    json_set_optvalue(json, mesh->subdivision_catmullclark_smooth, "subdivision_catmullclark_smooth");
-    json_set_optvalue(json, mesh->subdivision_bezier_level, "subdivision_bezier_level");
-    json_set_optvalue(json, mesh->subdivision_bezier_uniform, "subdivision_bezier_uniform");
+    // a mesh read from another file, or a scene shape, is the base that the members given here override
+    auto pending = _JsonPendingMesh();
+    pending.mesh = mesh;
+    pending.arena = json_scene_arena;
+    pending.names = std::move(names);
+    pending.mesh_loaded = mesh_loaded;
+    if(not shape.empty()) {
+        error_if_not(json_scene_arena, "shape %s named outside of a scene file\n", shape.c_str());
+        error_if_not(json_mesh.empty() and binary_mesh.empty(), "mesh with both a shape and a mesh file\n");
+        pending.shape = shape;
+        json_pending_instances.push_back(std::move(pending));
+        return mesh;
+    }
+    pending.filename = (binary_mesh.empty()) ? json_mesh : binary_mesh;
+    pending.binary = not binary_mesh.empty();
+    if(json_scene_arena) json_pending_meshes.push_back(std::move(pending));
+    else json_load_mesh(pending);
+    return mesh;
+}
+
+Mesh* _json_load_mesh(const string& filename) {
+    json_texture_path_push(filename);
+    JsonReader reader(filename);
+    auto mesh = json_read_mesh(reader);
+    reader.end();
+    json_texture_path_pop();
     return mesh;
 }
 
-vector<Mesh*> json_parse_meshes(const jsonvalue& json) {
+Mesh* load_json_mesh(const string& filename) {
+    auto mesh = _json_load_mesh(filename);
+    json_load_textures();
+    return mesh;
+}
+
+vector<Mesh*> json_read_meshes(JsonReader& reader, const std::function<void(Mesh*)>& mesh_loaded) {
     auto meshes = vector<Mesh*>();
-    for(auto& value : json.as_array_ref())
-        meshes.push_back( json_parse_mesh(value) );
+    reader.begin_array();
+    while(reader.next_element()) {
+        meshes.push_back( json_read_mesh(reader, mesh_loaded) );
+    }
     return meshes;
 }
 
+// reads the named shapes of a scene (shapes are read in full before the scene meshes that use them)
+map<string,Mesh*> json_read_shapes(JsonReader& reader) {
+    auto shapes = map<string,Mesh*>();
+    auto name = string();
+    reader.begin_object();
+    while(reader.next_member(name)) {
+        shapes[name] = json_read_mesh(reader);
+        error_if_not(json_pending_instances.empty() or json_pending_instances.back().mesh != shapes[name], "shape %s names another shape\n", name.c_str());
+    }
+    return shapes;
+}
+
 Light* json_parse_light(const jsonvalue& json) {
-    auto light = new Light();
+    auto light = json_new<Light>(json_scene_arena);
     json_set_optvalue(json, light->frame, "frame");
     json_set_optvalue(json, light->intensity, "intensity");
     return light;
@@ -243,58 +740,304 @@ vector<Light*> json_parse_lights(const jsonvalue& json) {
 }
 
 
-Scene* json_parse_scene(const jsonvalue& json) {
-    // prepare scene
-    auto scene = new Scene();
-    // camera
-    if (json.object_contains("camera")) scene->camera = json_parse_camera(json.object_element("camera"));
-    if (json.object_contains("lookat_camera")) scene->camera = json_parse_lookatcamera(json.object_element("lookat_camera"));
-    // surfaces
-    if(json.object_contains("surfaces")) scene->surfaces = json_parse_surfaces(json.object_element("surfaces"));
-    // meshes
-    if(json.object_contains("json_meshes")) {
-        json_texture_path_push(json.object_element("json_meshes").as_string());
-        scene->meshes = json_parse_meshes(load_json(json.object_element("json_meshes").as_string()));
-        json_texture_path_pop();
+void json_read_scene(JsonReader& reader, Scene* scene, const std::function<void(Mesh*)>& mesh_loaded) {
+    // members are read in file order, so those that take precedence over others are kept aside
+    // (a lookat camera over a camera, inline meshes over external ones)
+    Camera* camera = nullptr;
+    Camera* lookat_camera = nullptr;
+    auto meshes = vector<Mesh*>(), external_meshes = vector<Mesh*>();
+    auto inline_meshes = false;
+    auto name = string();
+    reader.begin_object();
+    while(reader.next_member(name)) {
+        // camera
+        if(name == "camera") camera = json_parse_camera(reader.read_value());
+        else if(name == "lookat_camera") lookat_camera = json_parse_lookatcamera(reader.read_value());
+        // surfaces
+        else if(name == "surfaces") scene->surfaces = json_parse_surfaces(reader.read_value());
+        // meshes
+        else if(name == "json_meshes") {
+            auto filename = reader.read_value().as_string();
+            json_texture_path_push(filename);
+            JsonReader meshes_reader(filename);
+            external_meshes = json_read_meshes(meshes_reader, mesh_loaded);
+            meshes_reader.end();
+            json_texture_path_pop();
+        }
+        else if(name == "meshes") { meshes = json_read_meshes(reader, mesh_loaded); inline_meshes = true; }
+        // shapes and materials shared by name
+        else if(name == "shapes") scene->shapes = json_read_shapes(reader);
+        else if(name == "materials") scene->materials = json_parse_materials(reader.read_value());
+        // lights
+        else if(name == "lights") scene->lights = json_parse_lights(reader.read_value());
+        // rendering parameters
+        else if(name == "image_width") json_set_value(reader.read_value(), scene->image_width);
+        else if(name == "image_height") json_set_value(reader.read_value(), scene->image_height);
+        else if(name == "image_samples") json_set_value(reader.read_value(), scene->image_samples);
+        else if(name == "background") json_set_value(reader.read_value(), scene->background);
+        else if(name == "ambient") json_set_value(reader.read_value(), scene->ambient);
+        else reader.skip_value();
     }
-    if(json.object_contains("meshes")) {
-        scene->meshes = json_parse_meshes(json.object_element("meshes"));
+    if(lookat_camera) scene->camera = lookat_camera;
+    else if(camera) scene->camera = camera;
+    scene->meshes = (inline_meshes) ? meshes : external_meshes;
+    // materials named anywhere in the file are known once it is read
+    for(auto& pending : json_pending_materials) {
+        auto material = scene->materials.find(pending.second);
+        error_if_not(material != scene->materials.end(), "unknown material %s\n", pending.second.c_str());
+        if(material != scene->materials.end()) *pending.first = material->second;
     }
-    // lights
-    if(json.object_contains("lights")) scene->lights = json_parse_lights(json.object_element("lights"));
-    // rendering parameters
-    json_set_optvalue(json, scene->image_width, "image_width");
-    json_set_optvalue(json, scene->image_height, "image_height");
-    json_set_optvalue(json, scene->image_samples, "image_samples");
-    json_set_optvalue(json, scene->background, "background");
-    json_set_optvalue(json, scene->ambient, "ambient");
-    // done
-    return scene;
+    json_pending_materials.clear();
+    for(auto& pending : json_pending_loaded) pending.second(pending.first);
+    json_pending_loaded.clear();
 }
 
-Scene* load_json_scene(const string& filename) {
-    json_texture_cache.clear();
+Scene::~Scene() { release_scene_assets(this); }
+
+Scene* load_json_scene(const string& filename, const std::function<void(Scene*,Mesh*)>& mesh_loaded) {
     json_texture_paths = { "" };
-    auto scene = json_parse_scene(load_json(filename));
-    json_texture_cache.clear();
+    // the scene is read first, only noting the meshes and textures in other files, which are then
+    // loaded all together, in parallel (the textures named by those meshes are decoded last)
+    auto scene = new Scene();
+    auto loaded = std::function<void(Mesh*)>();
+    if(mesh_loaded) loaded = [&](Mesh* mesh) { mesh_loaded(scene, mesh); };
+    json_scene_arena = &scene->arena;
+    JsonReader reader(filename);
+    json_read_scene(reader, scene, loaded);
+    reader.end();
+    json_scene_arena = nullptr;
+    auto meshes = vector<_JsonPendingMesh>();
+    auto textures = vector<pair<texture*,string>>();
+    std::swap(meshes, json_pending_meshes);
+    std::swap(textures, json_pending_textures);
+    // each mesh file is read once, however many meshes reference it, and is kept cached while loading
+    auto files = map<string,bool>();
+    for(auto& pending : meshes) files[pending.filename] = pending.binary;
+    auto file_list = vector<pair<string,bool>>(files.begin(), files.end());
+    auto file_keys = vector<string>(file_list.size());
+    parallel_for(file_list.size() + textures.size(), [&](int i) {
+        if(i < (int)file_list.size()) _json_acquire_mesh(file_list[i].first, file_list[i].second, file_keys[i]);
+        else json_load_texture(textures[i-file_list.size()].first, textures[i-file_list.size()].second);
+    });
+    json_load_textures();
+    parallel_for(meshes.size(), [&](int i) { json_load_mesh(meshes[i]); });
+    for(auto& key : file_keys) _json_release_mesh(key);
+    // shapes are complete once their files are loaded
+    auto instances = vector<_JsonPendingMesh>();
+    std::swap(instances, json_pending_instances);
+    for(auto& pending : instances) json_instance_mesh(pending, scene->shapes);
     json_texture_paths = { "" };
+    // the scene keeps its textures cached until it is released
+    auto scene_textures = set<texture*>();
+    for(auto mesh : scene->meshes) _material_textures(mesh->mat, scene_textures);
+    for(auto& shape : scene->shapes) _material_textures(shape.second->mat, scene_textures);
+    for(auto& material : scene->materials) _material_textures(material.second, scene_textures);
+    for(auto surface : scene->surfaces) {
+        _material_textures(surface->mat, scene_textures);
+        if(surface->displacement_txt) scene_textures.insert(surface->displacement_txt);
+    }
+    {
+        std::lock_guard<std::mutex> lock(asset_cache_mutex);
+        _asset_cache_reference(scene_textures, 1);
+        scene->_cached_textures.assign(scene_textures.begin(), scene_textures.end());
+    }
+    asset_cache_evict();
     return scene;
 }
 
+// copies a mesh into arena, with its levels of detail, pointing to the copies of the materials and shapes
+Mesh* _clone_mesh(Mesh* mesh, Arena& arena, map<Material*,Material*>& materials, const map<Mesh*,Mesh*>& shapes) {
+    if(not mesh) return nullptr;
+    auto clone = arena.make<Mesh>(*mesh);
+    if(mesh->mat and not materials.count(mesh->mat)) materials[mesh->mat] = arena.make<Material>(*mesh->mat);
+    if(mesh->mat) clone->mat = materials[mesh->mat];
+    if(mesh->shape) clone->shape = shapes.at(mesh->shape);
+    for(auto& lod : clone->_lods) lod = _clone_mesh(lod, arena, materials, shapes);
+    return clone;
+}
+
+Scene* clone_scene(Scene* scene) {
+    auto clone = new Scene();
+    auto& arena = clone->arena;
+    clone->camera = arena.make<Camera>(*scene->camera);
+    clone->image_width = scene->image_width;
+    clone->image_height = scene->image_height;
+    clone->image_samples = scene->image_samples;
+    clone->background = scene->background;
+    clone->ambient = scene->ambient;
+    clone->draw_wireframe = scene->draw_wireframe;
+    clone->draw_animated = scene->draw_animated;
+    clone->draw_gpu_skinning = scene->draw_gpu_skinning;
+    clone->draw_captureimage = scene->draw_captureimage;
+    clone->draw_lod = scene->draw_lod;
+    clone->draw_lod_pixels = scene->draw_lod_pixels;
+    clone->draw_lod_fade = scene->draw_lod_fade;
+    clone->draw_gpu_tessellation = scene->draw_gpu_tessellation;
+    clone->draw_tess_pixels = scene->draw_tess_pixels;
+    // materials and shapes stay shared by the objects that shared them
+    auto materials = map<Material*,Material*>();
+    for(auto& material : scene->materials) {
+        materials[material.second] = arena.make<Material>(*material.second);
+        clone->materials[material.first] = materials[material.second];
+    }
+    auto shapes = map<Mesh*,Mesh*>();
+    for(auto& shape : scene->shapes) {
+        shapes[shape.second] = _clone_mesh(shape.second, arena, materials, shapes);
+        clone->shapes[shape.first] = shapes[shape.second];
+    }
+    for(auto mesh : scene->meshes) clone->meshes.push_back(_clone_mesh(mesh, arena, materials, shapes));
+    for(auto surface : scene->surfaces) {
+        auto copy = arena.make<Surface>(*surface);
+        if(surface->mat and not materials.count(surface->mat)) materials[surface->mat] = arena.make<Material>(*surface->mat);
+        if(surface->mat) copy->mat = materials[surface->mat];
+        copy->_display_mesh = _clone_mesh(surface->_display_mesh, arena, materials, shapes);
+        clone->surfaces.push_back(copy);
+    }
+    for(auto light : scene->lights) clone->lights.push_back(arena.make<Light>(*light));
+    // textures are shared, and kept cached until both scenes are released
+    {
+        std::lock_guard<std::mutex> lock(asset_cache_mutex);
+        clone->_cached_textures = scene->_cached_textures;
+        _asset_cache_reference(set<texture*>(clone->_cached_textures.begin(), clone->_cached_textures.end()), 1);
+    }
+    return clone;
+}
+
+// sets a member of a material, as named in scene files (false if unknown)
+bool _set_scene_member(Material* material, const vector<string>& path, int i, const jsonvalue& value) {
+    if(i != (int)path.size()-1) return false;
+    auto& name = path[i];
+    if(name == "kd") json_set_value(value, material->kd);
+    else if(name == "ks") json_set_value(value, material->ks);
+    else if(name == "kr") json_set_value(value, material->kr);
+    else if(name == "n") json_set_value(value, material->n);
+    else return false;
+    return true;
+}
+
+// sets a member of a mesh, or of its material, as named in scene files (false if unknown)
+bool _set_scene_member(Mesh* mesh, const vector<string>& path, int i, const jsonvalue& value) {
+    auto& name = path[i];
+    if(name == "material" and mesh->mat) return _set_scene_member(mesh->mat, path, i+1, value);
+    if(i != (int)path.size()-1) return false;
+    if(name == "frame") json_set_value(value, mesh->frame);
+    else if(name == "subdivision_catmullclark_level") json_set_value(value, mesh->subdivision_catmullclark_level);
+    else if(name == "subdivision_catmullclark_smooth") json_set_value(value, mesh->subdivision_catmullclark_smooth);
+    else if(name == "subdivision_bezier_level") json_set_value(value, mesh->subdivision_bezier_level);
+    else if(name == "subdivision_bezier_uniform") json_set_value(value, mesh->subdivision_bezier_uniform);
+    else return false;
+    return true;
+}
+
+// sets a member of a surface, or of its material, as named in scene files (false if unknown)
+bool _set_scene_member(Surface* surface, const vector<string>& path, int i, const jsonvalue& value) {
+    auto& name = path[i];
+    if(name == "material" and surface->mat) return _set_scene_member(surface->mat, path, i+1, value);
+    if(i != (int)path.size()-1) return false;
+    if(name == "frame") json_set_value(value, surface->frame);
+    else if(name == "radius") json_set_value(value, surface->radius);
+    else if(name == "isquad") json_set_value(value, surface->isquad);
+    else if(name == "displacement_depth") json_set_value(value, surface->displacement_depth);
+    else if(name == "subdivision_level") json_set_value(value, surface->subdivision_level);
+    else if(name == "subdivision_smooth") json_set_value(value, surface->subdivision_smooth);
+    else return false;
+    return true;
+}
+
+// sets a member of a light, as named in scene files (false if unknown)
+bool _set_scene_member(Light* light, const vector<string>& path, int i, const jsonvalue& value) {
+    if(i != (int)path.size()-1) return false;
+    auto& name = path[i];
+    if(name == "frame") json_set_value(value, light->frame);
+    else if(name == "intensity") json_set_value(value, light->intensity);
+    else return false;
+    return true;
+}
+
+// sets a member of a camera, as named in scene files (false if unknown)
+bool _set_scene_member(Camera* camera, const vector<string>& path, int i, const jsonvalue& value) {
+    if(i != (int)path.size()-1) return false;
+    auto& name = path[i];
+    if(name == "frame") json_set_value(value, camera->frame);
+    else if(name == "width") json_set_value(value, camera->width);
+    else if(name == "height") json_set_value(value, camera->height);
+    else if(name == "dist") json_set_value(value, camera->dist);
+    else if(name == "focus") json_set_value(value, camera->focus);
+    else return false;
+    return true;
+}
+
+// sets a member of each element of a list (false if there are none, or for any it fails for)
+template<typename T>
+bool _set_scene_members(const vector<T*>& elements, const vector<string>& path, int i, const jsonvalue& value) {
+    auto ok = not elements.empty();
+    for(auto element : elements) ok = _set_scene_member(element, path, i, value) and ok;
+    return ok;
+}
+
+// sets a member of the element of a list named by index, or of all of them for "*"
+template<typename T>
+bool _set_scene_elements(const vector<T*>& elements, const vector<string>& path, int i, const jsonvalue& value) {
+    if(i+1 >= (int)path.size()) return false;
+    if(path[i] == "*") return _set_scene_members(elements, path, i+1, value);
+    if(path[i].empty() or path[i].find_first_not_of("0123456789") != string::npos) return false;
+    auto index = atoi(path[i].c_str());
+    if(index >= (int)elements.size()) return false;
+    return _set_scene_member(elements[index], path, i+1, value);
+}
+
+// sets a member of the element of a map named by name, or of all of them for "*"
+template<typename T>
+bool _set_scene_elements(const map<string,T*>& elements, const vector<string>& path, int i, const jsonvalue& value) {
+    if(i+1 >= (int)path.size()) return false;
+    if(path[i] == "*") {
+        auto list = vector<T*>();
+        for(auto& element : elements) list.push_back(element.second);
+        return _set_scene_members(list, path, i+1, value);
+    }
+    auto element = elements.find(path[i]);
+    if(element == elements.end()) return false;
+    return _set_scene_member(element->second, path, i+1, value);
+}
+
+bool set_scene_value(Scene* scene, const string& path, const jsonvalue& value) {
+    auto names = vector<string>();
+    auto name = string();
+    std::istringstream stream(path);
+    while(std::getline(stream, name, '.')) names.push_back(name);
+    if(names.empty()) return false;
+    if(names.size() == 1) {
+        if(names[0] == "image_width") json_set_value(value, scene->image_width);
+        else if(names[0] == "image_height") json_set_value(value, scene->image_height);
+        else if(names[0] == "image_samples") json_set_value(value, scene->image_samples);
+        else if(names[0] == "background") json_set_value(value, scene->background);
+        else if(names[0] == "ambient") json_set_value(value, scene->ambient);
+        else return false;
+        return true;
+    }
+    if(names[0] == "camera") return _set_scene_member(scene->camera, names, 1, value);
+    if(names[0] == "meshes") return _set_scene_elements(scene->meshes, names, 1, value);
+    if(names[0] == "shapes") return _set_scene_elements(scene->shapes, names, 1, value);
+    if(names[0] == "surfaces") return _set_scene_elements(scene->surfaces, names, 1, value);
+    if(names[0] == "lights") return _set_scene_elements(scene->lights, names, 1, value);
+    if(names[0] == "materials") return _set_scene_elements(scene->materials, names, 1, value);
+    return false;
+}
+
 Scene* create_test_scene_sphere() {
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    auto camera            = scene->arena.make<Camera>();
     camera->frame          = frame3f(z3f*2.5,x3f,y3f,z3f);
     camera->focus          = 2.5f;
     
-    auto light_point       = new Light();
+    auto light_point       = scene->arena.make<Light>();
     light_point->frame     = frame3f(z3f*5,x3f,y3f,z3f);
     light_point->intensity = one3f*10;
     
-    auto surf_sphere       = new Surface();
-    surf_sphere->mat       = new Material();
+    auto surf_sphere       = scene->arena.make<Surface>();
+    surf_sphere->mat       = scene->arena.make<Material>();
     surf_sphere->mat->n    = 100;
     
-    auto scene             = new Scene();
     scene->background      = one3f*0.2;
     scene->ambient         = one3f*0.2;
     scene->image_width     = 512;
@@ -309,35 +1052,35 @@ Scene* create_test_scene_sphere() {
 
 Scene* create_test_scene_sphereplane() {
     // sphere, plane, and shadows
-    auto camera            = new Camera();
+    auto scene             = new Scene();
+    auto camera            = scene->arena.make<Camera>();
     camera->frame          = frame3f(z3f*4,x3f,y3f,z3f);
     camera->focus          = 4.0f;
     
-    auto light_point       = new Light();
+    auto light_point       = scene->arena.make<Light>();
     light_point->frame     = frame3f({6,12,6},x3f,y3f,z3f);
     light_point->intensity = one3f*100;
     
-    auto surf_plane        = new Surface();
+    auto surf_plane        = scene->arena.make<Surface>();
     surf_plane->frame      = frame3f(-y3f,x3f,-z3f,y3f);
     surf_plane->radius     = 100;
     surf_plane->isquad     = true;
-    surf_plane->mat        = new Material();
+    surf_plane->mat        = scene->arena.make<Material>();
     surf_plane->mat->kd    = one3f;
     surf_plane->mat->ks    = zero3f;
     surf_plane->mat->n     = 100;
     surf_plane->mat->kr    = zero3f;
     
-    auto surf_sphere       = new Surface();
+    auto surf_sphere       = scene->arena.make<Surface>();
     surf_sphere->frame     = identity_frame3f;
     surf_sphere->radius    = 1;
     surf_sphere->isquad    = false;
-    surf_sphere->mat       = new Material();
+    surf_sphere->mat       = scene->arena.make<Material>();
     surf_sphere->mat->kd   = {1,0.75,0.75};
     surf_sphere->mat->ks   = zero3f;
     surf_sphere->mat->n    = 100;
     surf_sphere->mat->kr   = zero3f;
     
-    auto scene             = new Scene();
     scene->background      = one3f*0.2;
     scene->ambient         = one3f*0.2;
     scene->image_width     = 512;
@@ -18,11 +18,11 @@ struct Material {
     vec3f       kr = zero3f;            // reflection coefficient
     vec3f       ke = zero3f;            // emission coefficient
     
-    image3f*    kd_txt   = nullptr;     // diffuse texture
-    image3f*    ks_txt   = nullptr;     // specular texture
-    image3f*    kr_txt   = nullptr;     // reflection texture
-    image3f*    norm_txt = nullptr;     // normal texture
-    image3f*    ke_txt   = nullptr;     // emission texture
+    texture*    kd_txt   = nullptr;     // diffuse texture
+    texture*    ks_txt   = nullptr;     // specular texture
+    texture*    kr_txt   = nullptr;     // reflection texture
+    texture*    norm_txt = nullptr;     // normal texture
+    texture*    ke_txt   = nullptr;     // emission texture
     
     bool        double_sided = false;   // double-sided material
     bool        microfacet   = false;   // use microfacet formulation
@@ -41,14 +41,25 @@ struct Mesh {
     vector<int>     point;                      // point
     vector<vec2i>   line;                       // line
     vector<vec4i>   spline;                     // cubic bezier segments
-    Material*       mat = new Material();       // material
+    Material*       mat = nullptr;              // material (owned by the scene, or by the mesh if loaded alone)
     
     int  subdivision_catmullclark_level = 0;        // catmullclark subdiv level
     bool subdivision_catmullclark_smooth = false;   // catmullclark subdiv smooth
     int  subdivision_bezier_level = 0;              // bezier subdiv level
     bool subdivision_bezier_uniform = true;         // bezier subdiv: true=uniform, false=de casteljau
     
-
+    Mesh*           shape = nullptr;            // scene shape whose geometry and subdivision this mesh draws in
+                                                // its own frame and material (nullptr if it has its own)
+    
+    vector<Mesh*>   _lods;                      // coarser subdivision levels of detail, coarsest first
+    
+    // cached bounds, refreshed by update_bounds (call invalidate_bounds after changing pos)
+    bool    _bbox_local_valid = false;              // whether _bbox_local matches pos
+    range3f _bbox_local;                            // bounding box in the mesh frame
+    frame3f _bounds_frame;                          // frame the world space bounds were computed for
+    range3f _bbox;                                  // world space bounding box
+    vec3f   _bsphere_center = zero3f;               // world space bounding sphere center
+    float   _bsphere_radius = -1;                   // world space bounding sphere radius (<0 if empty)
 };
 
 // surface made of either a sphere or a quad (as determined by
@@ -60,12 +71,20 @@ struct Surface {
     float       radius = 1;                 // radius
     bool        isquad = false;             // whether it's a quad
     float        displacement_depth = 0;
-    Material*   mat = new Material();       // material
+    texture*    displacement_txt = nullptr;  // displacement map, its red channel offsets quads along z
+    Material*   mat = nullptr;              // material (owned by the scene)
 
     
     Mesh*       _display_mesh = nullptr;    // display mesh
     int         subdivision_level = 0;
     bool        subdivision_smooth = false;
+    
+    // cached bounds, refreshed by update_bounds when frame or radius change
+    frame3f     _bounds_frame;              // frame the world space bounds were computed for
+    float       _bounds_radius = -1;        // radius the world space bounds were computed for (<0 if never)
+    range3f     _bbox;                      // world space bounding box
+    vec3f       _bsphere_center = zero3f;   // world space bounding sphere center
+    float       _bsphere_radius = -1;       // world space bounding sphere radius
 };
 
 // point light at frame.o with intensity intensity
@@ -93,8 +112,11 @@ struct Camera {
 // if a ray misses) the ambient illumination, the
 // image resolution (image_width, image_height) and
 // the samples per pixel (image_samples).
+// all scene objects are allocated in the scene arena, and deleting the scene frees them at once.
 struct Scene {
-    Camera*             camera = new Camera();  // camera
+    Arena               arena;                  // owns the cameras, lights, surfaces, meshes and materials
+    
+    Camera*             camera = arena.make<Camera>();  // camera
     
     int                 image_width = 512;      // image resolution in x
     int                 image_height = 512;     // image resolution in y
@@ -107,26 +129,83 @@ struct Scene {
     
     vector<Surface*>    surfaces;               // surfaces
     vector<Mesh*>       meshes;                 // meshes
+    map<string,Mesh*>   shapes;                 // named meshes that meshes instance, not drawn themselves
+    map<string,Material*> materials;            // named materials that meshes and surfaces share
     
     
     bool                draw_wireframe = false; // whether to use wireframe for interactive drawing
     bool                draw_animated = false;  // whether to draw with animation
     bool                draw_gpu_skinning = false;  // whether skinning is performed on the gpu
     bool                draw_captureimage = false;  // whether to capture the image in the next frame
+    bool                draw_lod = false;       // whether to select subdivision levels of detail per frame
+    float               draw_lod_pixels = 16;   // screen area in pixels targeted for each face by lod selection
+    bool                draw_lod_fade = false;  // whether to cross-fade between levels of detail
+    bool                draw_gpu_tessellation = false;  // whether splines and surfaces are tessellated on the gpu
+    float               draw_tess_pixels = 8;   // screen length in pixels targeted for gpu tessellated edges
+    
+    vector<texture*>    _cached_textures;       // cached textures the scene references (see release_scene_assets)
     
+    // releases the cached textures and frees all scene objects
+    ~Scene();
 };
 
 // grab all scene textures
-vector<image3f*> get_textures(Scene* scene);
+vector<texture*> get_textures(Scene* scene);
+
+// mesh holding the geometry of a mesh, its shape for instances
+inline Mesh* mesh_shape(Mesh* mesh) { return (mesh->shape) ? mesh->shape : mesh; }
+
+// mark mesh positions as changed, so that the next update_bounds recomputes them
+void invalidate_bounds(Mesh* mesh);
+// update the cached world space bounds of a mesh if its positions or frame changed
+void update_bounds(Mesh* mesh);
+// update the cached world space bounds of a surface if its frame or radius changed
+void update_bounds(Surface* surface);
 
 // create a Camera at eye, pointing towards center with up vector up, and with specified image plane params
-Camera* lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
+Camera lookat_camera(vec3f eye, vec3f center, vec3f up, float width, float height, float dist);
 
 // set camera view with a "turntable" modification
 void set_view_turntable(Camera* camera, float rotate_phi, float rotate_theta, float dolly, float pan_x, float pan_y);
 
-// load a scene from a json file
-Scene* load_json_scene(const string& filename);
+// whether texture mip levels are cached on disk, next to each source image with a ".mips" suffix
+extern bool texture_mip_cache;
+
+// textures and meshes read from other files by scenes are kept in a process-wide cache, keyed by
+// canonical path and modification time, so that scenes loaded one after the other read each file once;
+// assets that no loaded scene references are evicted, least recently used first, once the cache
+// holds more than asset_cache_budget bytes
+extern size_t asset_cache_budget;
+// called with each texture evicted from the cache, before it is deleted (e.g. to free its OpenGL copy)
+extern std::function<void(texture*)> asset_cache_evicted;
+// release the cached assets that a scene references, once it is not used anymore
+void release_scene_assets(Scene* scene);
+
+// load a scene from a json file, streamed so that mesh arrays are decoded straight into the meshes,
+// then load the meshes and textures in other files that it names, in parallel, or take them from
+// the asset cache (if mesh_loaded is set, it is called with the scene and each mesh as soon as the mesh is
+// complete, while the rest of the scene is still being loaded, possibly from several threads at once)
+Scene* load_json_scene(const string& filename, const std::function<void(Scene*,Mesh*)>& mesh_loaded = nullptr);
+
+// load a mesh from a json file, with the members of a mesh in a scene file
+// (the mesh and its material are allocated on the heap, owned by the caller)
+Mesh* load_json_mesh(const string& filename);
+
+// load a mesh from a binary mesh file, mapped and copied without parsing
+// (binary meshes keep geometry, frame, subdivision settings and material coefficients, but not textures)
+Mesh* load_binary_mesh(const string& filename);
+// save a mesh to a binary mesh file, for meshes in scene files to reference with "binary_mesh"
+void save_binary_mesh(const string& filename, Mesh* mesh);
+
+// copy a scene into a new arena, sharing its cached textures, so that it can be changed and subdivided
+// without reloading it (materials and shapes shared by name stay shared within the copy)
+Scene* clone_scene(Scene* scene);
+
+// set a scene value named by a path of members as in scene files, with list elements named by index
+// and map elements by name, or all of them with "*" (e.g. "image_width", "camera.dist",
+// "meshes.0.subdivision_catmullclark_level", "shapes.*.material.kd"); returns false for unknown paths
+// (values of meshes and surfaces take effect when they are subdivided)
+bool set_scene_value(Scene* scene, const string& path, const jsonvalue& value);
 
 // create test scenes that do not need to be loaded from a file
 Scene* create_test_scene(int scene_type);